@@ -0,0 +1,504 @@
+#include "connection.h"
+#include "event_loop.h"
+#include "helpers.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <csignal>
+#include <sys/resource.h>
+
+using namespace std;
+
+// Datagrams handed to the kernel by a single sendmmsg
+#define SEND_BATCH 64
+
+// Send times are remembered for this many sequence numbers
+#define SEND_RING (1 << 22)
+
+// A run is over once nothing was delivered for this long
+#define SETTLE_MS 1000
+
+// Digits of the sequence number at the start of a STRING payload
+#define SEQ_DIGITS 10
+
+struct bench_options {
+    struct sockaddr_in server;
+    int subscribers;
+    int publishers;
+    double rate;        // messages per second over all publishers, 0 is flat out
+    double duration;    // seconds of publishing per run
+    vector<int> topics;
+    vector<int> fanouts;
+    vector<int> backlogs;
+};
+
+// One payload of the mix, the topic is picked by the publisher
+struct payload {
+    uint8_t data_t;
+    string body;
+};
+
+// When every sequence number went out, publishers write, the
+// subscriber side reads
+static atomic<uint64_t> send_ns[SEND_RING];
+
+static uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static string base64_decode(const string &in) {
+    static const string chars =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    int val = 0, bits = -8;
+
+    for (char c : in) {
+        size_t d = chars.find(c);
+        if (d == string::npos)
+            break;
+        val = ((val << 6) + (int)d) & 0xffffff;
+        bits += 6;
+        if (bits >= 0) {
+            out.push_back((char)((val >> bits) & 0xff));
+            bits -= 8;
+        }
+    }
+    return out;
+}
+
+// Pulls every payload_base64 out of one of the udp_client JSON files,
+// they are whole datagrams so only the data type and the payload are kept
+static vector<payload> load_payloads(const char *path) {
+    ifstream file(path);
+    DIE(!file, "open payloads");
+    stringstream contents;
+    contents << file.rdbuf();
+    string json = contents.str();
+
+    vector<payload> mix;
+    size_t pos = 0;
+    while ((pos = json.find("\"payload_base64\"", pos)) != string::npos) {
+        size_t start = json.find('"', json.find(':', pos) + 1) + 1;
+        size_t end = json.find('"', start);
+        string raw = base64_decode(json.substr(start, end - start));
+        pos = end + 1;
+
+        if (raw.size() < DATAGRAM_HEADER_LEN)
+            continue;
+        payload p{(uint8_t)raw[TOPIC_LEN], raw.substr(DATAGRAM_HEADER_LEN)};
+
+        // Too short for its data type, the broker would drop it anyway
+        size_t need[] = {sizeof(packet_int), sizeof(packet_short_real),
+                         sizeof(packet_float), 0};
+        if (p.data_t > PACKET_STRING || p.body.size() < need[p.data_t])
+            continue;
+        if (p.data_t == PACKET_STRING && p.body.size() < SEQ_DIGITS)
+            p.body.resize(SEQ_DIGITS, 'x');
+        mix.push_back(p);
+    }
+    return mix;
+}
+
+// Hides seq in the value, SHORT_REAL only has 16 bits so those
+// messages count towards throughput but can't be timed
+static void stamp(char *body, uint8_t data_t, uint32_t seq) {
+    uint32_t val = htonl(seq);
+    char digits[SEQ_DIGITS + 1];
+
+    if (data_t == PACKET_INT || data_t == PACKET_FLOAT) {
+        memcpy(body + 1, &val, sizeof(val));
+    } else if (data_t == PACKET_STRING) {
+        snprintf(digits, sizeof(digits), "%0*u", SEQ_DIGITS, seq);
+        memcpy(body, digits, SEQ_DIGITS);
+    }
+}
+
+static bool read_stamp(const packet *p, uint32_t *seq) {
+    uint32_t val;
+    char digits[SEQ_DIGITS + 1];
+
+    if (p->data_t == PACKET_INT || p->data_t == PACKET_FLOAT) {
+        memcpy(&val, p->payload + 1, sizeof(val));
+        *seq = ntohl(val);
+        return true;
+    }
+    if (p->data_t == PACKET_STRING) {
+        memcpy(digits, p->payload, SEQ_DIGITS);
+        digits[SEQ_DIGITS] = 0;
+        *seq = strtoul(digits, nullptr, 10);
+        return true;
+    }
+    return false;
+}
+
+// Shared between the publishers of one run
+struct publish_state {
+    const vector<payload> *mix;
+    string prefix;
+    int topics;
+    atomic<uint32_t> *next_seq;
+    atomic<uint64_t> sent{0};
+    atomic<bool> stop{false};
+};
+
+// Sends count messages (or until told to stop when it's 0) at rate
+// messages per second (flat out when it's 0), SEND_BATCH datagrams
+// per system call
+static void publish(const bench_options *options, publish_state *state,
+                    uint64_t count, double rate, uint32_t seed) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(sockfd < 0, "socket");
+    int ret = connect(sockfd, (struct sockaddr *)&options->server, sizeof(options->server));
+    DIE(ret < 0, "connect");
+
+    static thread_local char buffers[SEND_BATCH][MAX_WIRE_LEN];
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov[SEND_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+
+    const vector<payload> &mix = *state->mix;
+    uint64_t start = now_ns(), done = 0;
+    uint32_t rnd = seed | 1;
+
+    while (!state->stop.load(memory_order_relaxed) && (!count || done < count)) {
+        uint64_t batch = SEND_BATCH;
+        if (count)
+            batch = min(batch, count - done);
+
+        // Only what's due by now goes out, so the rate holds without bursts
+        if (rate > 0) {
+            auto due = (uint64_t)((now_ns() - start) * rate / 1e9) + 1;
+            if (due <= done) {
+                auto wait = (int64_t)((done + 1) * 1e9 / rate) - (int64_t)(now_ns() - start);
+                this_thread::sleep_for(chrono::nanoseconds(max(wait, (int64_t)0)));
+                continue;
+            }
+            batch = min(batch, due - done);
+        }
+
+        uint32_t first = state->next_seq->fetch_add(batch);
+        for (uint64_t i = 0; i < batch; i++) {
+            uint32_t seq = first + i;
+            const payload &p = mix[seq % mix.size()];
+
+            // xorshift, so topics and data types don't line up
+            rnd ^= rnd << 13;
+            rnd ^= rnd >> 17;
+            rnd ^= rnd << 5;
+
+            char *buffer = buffers[i];
+            memset(buffer, 0, TOPIC_LEN);
+            snprintf(buffer, TOPIC_LEN, "%s%u", state->prefix.c_str(), rnd % state->topics);
+            buffer[TOPIC_LEN] = (char)p.data_t;
+            memcpy(buffer + DATAGRAM_HEADER_LEN, p.body.data(), p.body.size());
+            stamp(buffer + DATAGRAM_HEADER_LEN, p.data_t, seq);
+
+            iov[i].iov_base = buffer;
+            iov[i].iov_len = DATAGRAM_HEADER_LEN + p.body.size();
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        uint64_t t = now_ns();
+        for (uint64_t i = 0; i < batch; i++)
+            send_ns[(first + i) & (SEND_RING - 1)].store(t, memory_order_relaxed);
+
+        // A full socket buffer loses the batch, that's counted as not sent
+        int n = sendmmsg(sockfd, msgs, batch, 0);
+        DIE(n < 0 && errno != ENOBUFS && errno != EAGAIN && errno != ECONNREFUSED,
+            "sendmmsg");
+        if (n > 0)
+            state->sent += n;
+        done += batch;
+    }
+
+    close(sockfd);
+}
+
+// Every subscriber connection of a run, all on one event loop
+struct swarm {
+    EventLoop loop;
+    vector<unique_ptr<Connection>> conns;
+    vector<Connection *> by_fd;
+
+    uint64_t delivered = 0;
+    uint64_t replies = 0;
+    uint64_t last_delivery = 0;
+    int closed = 0;
+
+    // Only messages from seq on are timed
+    bool timing = false;
+    uint32_t timed_from = 0;
+    vector<uint64_t> latencies;
+};
+
+static void add_connection(swarm *s, const bench_options *options, const string &id,
+                           const vector<string> &topics, int sf) {
+    connection_handlers handlers;
+    handlers.on_packet = [s](const packet *p) {
+        uint64_t t = now_ns();
+        uint32_t seq;
+
+        s->delivered++;
+        s->last_delivery = t;
+        if (s->timing && read_stamp(p, &seq) && seq - s->timed_from < (1u << 31))
+            s->latencies.push_back(t - send_ns[seq & (SEND_RING - 1)].load(memory_order_relaxed));
+    };
+    // A batch subscribe answers for all of its topics at once
+    handlers.on_reply = [s](string_view reply) {
+        unsigned long topics = 1;
+        sscanf(string(reply).c_str(), "Subscribed to %lu topics", &topics);
+        s->replies += topics;
+    };
+    handlers.on_state = [s](int state, int) {
+        if (state == CONN_CLOSED)
+            s->closed++;
+    };
+
+    auto *conn = new Connection(&s->loop, id, options->server, handlers, false);
+    s->conns.emplace_back(conn);
+    for (const auto &topic : topics)
+        conn->subscribe(topic, sf);
+    conn->start();
+
+    if (conn->fd() >= (int)s->by_fd.size())
+        s->by_fd.resize(conn->fd() + 1);
+    if (conn->fd() >= 0)
+        s->by_fd[conn->fd()] = conn;
+}
+
+// Handles whatever the connections have for up to timeout ms
+static void pump(swarm *s, int timeout) {
+    int nready = s->loop.wait(timeout);
+    for (int i = 0; i < nready; i++) {
+        int fd = s->loop.events[i].data.fd;
+        if (fd < (int)s->by_fd.size() && s->by_fd[fd])
+            s->by_fd[fd]->handle(fd, s->loop.events[i].events);
+    }
+}
+
+// Keeps pumping until done() or until nothing comes in for SETTLE_MS
+template <typename F>
+static void settle(swarm *s, F done) {
+    uint64_t last = s->delivered + s->replies, since = now_ns();
+    while (!done()) {
+        pump(s, 10);
+        if (s->delivered + s->replies != last) {
+            last = s->delivered + s->replies;
+            since = now_ns();
+        } else if (now_ns() - since > SETTLE_MS * 1000000ull) {
+            break;
+        }
+    }
+}
+
+// Subscriber k of n follows every topic t with (t * fanout + j) % n == k
+// for some j < fanout, so each topic has exactly fanout subscribers
+static vector<vector<string>> spread(const string &prefix, int topics, int fanout, int n) {
+    vector<vector<string>> subscriptions(n);
+    for (int t = 0; t < topics; t++)
+        for (int j = 0; j < fanout; j++)
+            subscriptions[((long)t * fanout + j) % n].push_back(prefix + to_string(t));
+    return subscriptions;
+}
+
+static double percentile(vector<uint64_t> &samples, double p) {
+    if (samples.empty())
+        return 0;
+    size_t k = min(samples.size() - 1, (size_t)(p * samples.size()));
+    nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k] / 1000.0;
+}
+
+static void run(const bench_options *options, const vector<payload> *mix,
+                atomic<uint32_t> *next_seq, int index, int topics, int fanout, int backlog) {
+    string prefix = "bench/" + to_string(getpid()) + "/" + to_string(index) + "/";
+    int n = options->subscribers;
+    auto subscriptions = spread(prefix, topics, fanout, n);
+    uint64_t expected_replies = (uint64_t)topics * fanout;
+
+    publish_state state;
+    state.mix = mix;
+    state.prefix = prefix;
+    state.topics = topics;
+    state.next_seq = next_seq;
+
+    auto s = make_unique<swarm>();
+    auto connect_all = [&](swarm *s, int sf) {
+        for (int k = 0; k < n; k++)
+            add_connection(s, options, "b" + to_string(getpid()) + "-" + to_string(index) +
+                           "-" + to_string(k),
+                           subscriptions[k], sf);
+    };
+    auto subscribed = [&]() {
+        return s->replies >= expected_replies || s->closed == n;
+    };
+
+    connect_all(s.get(), backlog > 0);
+    settle(s.get(), subscribed);
+    if (!subscribed()) {
+        fprintf(stderr, "Only %lu of %lu subscriptions went through.\n",
+                s->replies, expected_replies);
+        exit(EXIT_FAILURE);
+    }
+
+    // Subscriptions reach the other workers through their mailboxes
+    for (uint64_t until = now_ns() + 100000000; now_ns() < until;)
+        pump(s.get(), 10);
+
+    // The backlog piles up while everyone is away, then all of it is
+    // replayed when they come back under the same IDs
+    double replay_rate = 0;
+    if (backlog > 0) {
+        s.reset();
+        this_thread::sleep_for(chrono::milliseconds(100));
+
+        publish(options, &state, backlog, options->rate, 1);
+        this_thread::sleep_for(chrono::milliseconds(200));
+        uint64_t stored = state.sent.load() * fanout;
+
+        s = make_unique<swarm>();
+        uint64_t start = now_ns();
+        connect_all(s.get(), 1);
+        settle(s.get(), [&]() { return s->delivered >= stored; });
+        if (s->delivered)
+            replay_rate = s->delivered * 1e9 / (s->last_delivery - start);
+        state.sent = 0;
+    }
+
+    // Live traffic, timed from publish to delivery
+    s->delivered = 0;
+    s->latencies.clear();
+    s->latencies.reserve(1 << 20);
+    s->timed_from = next_seq->load();
+    s->timing = true;
+
+    vector<thread> publishers;
+    double rate = options->rate / options->publishers;
+    uint64_t start = now_ns();
+    for (int i = 0; i < options->publishers; i++)
+        publishers.emplace_back(publish, options, &state, 0, rate, 2 + i);
+
+    while (now_ns() - start < options->duration * 1e9)
+        pump(s.get(), 10);
+    state.stop = true;
+    for (auto &publisher : publishers)
+        publisher.join();
+    uint64_t published = now_ns() - start;
+
+    uint64_t expected = state.sent * fanout;
+    settle(s.get(), [&]() { return s->delivered >= expected; });
+    uint64_t elapsed = max(s->last_delivery, start + 1) - start;
+
+    printf("%7d %7d %9d %10.0f %10.0f %6.2f%% %9.1f %9.1f %9.1f %9.1f %10.0f\n",
+           topics, fanout, backlog,
+           state.sent * 1e9 / published,
+           s->delivered * 1e9 / elapsed,
+           expected ? 100.0 * (expected - min(expected, s->delivered)) / expected : 0.0,
+           percentile(s->latencies, 0.5), percentile(s->latencies, 0.99),
+           percentile(s->latencies, 0.999), percentile(s->latencies, 1.0),
+           replay_rate);
+}
+
+static vector<int> parse_list(const char *arg) {
+    vector<int> values;
+    stringstream in(arg);
+    string item;
+    while (getline(in, item, ','))
+        values.push_back(atoi(item.c_str()));
+    return values;
+}
+
+int main(int argc, char *argv[]) {
+    // check usage
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s ip_server port_server [--subscribers N] [--publishers N]"
+                        " [--rate MSGS_PER_SEC] [--duration SECS] [--topics T,...]"
+                        " [--fanout F,...] [--backlog B,...] [--payloads FILE]\n", argv[0]);
+        return 0;
+    }
+
+    bench_options options{};
+    options.server.sin_family = AF_INET;
+    options.server.sin_port = htons(atoi(argv[2]));
+    DIE(inet_aton(argv[1], &options.server.sin_addr) == 0, "inet_aton");
+
+    // A single topic with one subscriber, published to as fast as we can
+    options.subscribers = 1;
+    options.publishers = 1;
+    options.rate = 0;
+    options.duration = 5;
+    options.topics = {1};
+    options.fanouts = {1};
+    options.backlogs = {0};
+    const char *payloads = "udp_client/sample_payloads.json";
+
+    for (int i = 3; i + 1 < argc; i++) {
+        if (!strcmp(argv[i], "--subscribers"))
+            options.subscribers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--publishers"))
+            options.publishers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--rate"))
+            options.rate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--duration"))
+            options.duration = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--topics"))
+            options.topics = parse_list(argv[++i]);
+        else if (!strcmp(argv[i], "--fanout"))
+            options.fanouts = parse_list(argv[++i]);
+        else if (!strcmp(argv[i], "--backlog"))
+            options.backlogs = parse_list(argv[++i]);
+        else if (!strcmp(argv[i], "--payloads"))
+            payloads = argv[++i];
+    }
+
+    if (options.subscribers < 1 || options.publishers < 1 || options.duration <= 0) {
+        fprintf(stderr, "Bad bench settings.\n");
+        return 0;
+    }
+    for (int fanout : options.fanouts) {
+        if (fanout < 1 || fanout > options.subscribers) {
+            fprintf(stderr, "The fanout must be between 1 and the number of subscribers.\n");
+            return 0;
+        }
+    }
+
+    vector<payload> mix = load_payloads(payloads);
+    if (mix.empty()) {
+        fprintf(stderr, "No usable payloads in %s.\n", payloads);
+        return 0;
+    }
+
+    // Every subscriber takes a socket and a timerfd
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, nullptr, _IONBF, BUFSIZ);
+
+    printf("%d subscribers, %d publishers, %s msgs/s for %.1fs, %zu payloads\n",
+           options.subscribers, options.publishers,
+           options.rate > 0 ? to_string((long)options.rate).c_str() : "max",
+           options.duration, mix.size());
+    printf("%7s %7s %9s %10s %10s %7s %9s %9s %9s %9s %10s\n",
+           "topics", "fanout", "backlog", "pub/s", "deliver/s", "lost",
+           "p50 us", "p99 us", "p999 us", "max us", "replay/s");
+
+    // Every run has its own topics, so what earlier runs left
+    // subscribed on the broker stays out of the way
+    atomic<uint32_t> next_seq{0};
+    int index = 0;
+    for (int topics : options.topics)
+        for (int fanout : options.fanouts)
+            for (int backlog : options.backlogs)
+                run(&options, &mix, &next_seq, index++, topics, fanout, backlog);
+
+    return 0;
+}
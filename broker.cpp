@@ -0,0 +1,2248 @@
+#include "broker.h"
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Generates a Server->Client packet with data type REPLY for a connection
+// that gets closed right after, so it doesn't wait for room in the socket
+static void send_reply(int fd, int version, const char *text) {
+    packet reply{};
+    reply.data_t = PACKET_REPLY;
+    strcpy(reply.payload, text);
+
+    char frame[MAX_FRAME_LEN];
+    size_t len;
+    const char *data = wire_bytes(version, &reply, strlen(text), frame, &len);
+    send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Topics aren't '\0' terminated when they take all 50 chars
+static string topic_of(const packet *p) {
+    return string(p->topic, strnlen(p->topic, TOPIC_LEN));
+}
+
+// The SF flag of a subscribe, -1 unless it's exactly 0 or 1
+static int sf_option(const char *token) {
+    if (!token || (strcmp(token, "0") && strcmp(token, "1")))
+        return -1;
+    return token[0] - '0';
+}
+
+static bool over(const sf_quota &quota, uint64_t messages, uint64_t bytes) {
+    return (quota.messages && messages > quota.messages) ||
+           (quota.bytes && bytes > quota.bytes);
+}
+
+// Arms a timerfd for when (CLOCK_MONOTONIC ns), or every when ns
+static void set_timer(int fd, uint64_t when, bool periodic = false) {
+    struct itimerspec spec{};
+    spec.it_value.tv_sec = when / 1000000000;
+    spec.it_value.tv_nsec = when % 1000000000;
+    if (periodic)
+        spec.it_interval = spec.it_value;
+    DIE(timerfd_settime(fd, periodic ? 0 : TFD_TIMER_ABSTIME, &spec, nullptr) < 0,
+        "timerfd_settime");
+}
+
+Worker::Worker(Broker *_broker, int _index, int portno)
+    : loop(_broker->options.io), pool(POOL_SLAB), retained(_broker->options.retain_limit) {
+    broker = _broker;
+    index = _index;
+    pending_wake = 0;
+    outboxed = 0;
+    udp_waiting = false;
+    published = 0;
+    subscribers_gen = interest_gen = 1;
+    metrics = worker_metrics{};
+    stats_wanted.store(nullptr);
+    ring = loop.ring;
+    udp_ring = nullptr;
+    store = nullptr;
+    if (broker->options.store_dir)
+        store = new Store(broker->options.store_dir, index,
+                          broker->options.fsync);
+
+    // Spilled entries only matter to this run, they are never synced
+    spillover = nullptr;
+    if (broker->options.sf_overflow == SF_SPILL)
+        spillover = new Store(broker->options.spill_dir, index, FSYNC_NEVER);
+
+    for (const auto &pattern : broker->options.retain)
+        retain_patterns.insert(pattern);
+
+    // Our share of what store and forward may hold
+    space.messages = space.bytes = 0;
+    const sf_quota &total = broker->options.total_quota;
+    int n = broker->nworkers;
+    quota.messages = total.messages ? max<uint64_t>(total.messages / n, 1) : 0;
+    quota.bytes = total.bytes ? max<uint64_t>(total.bytes / n, MAX_FRAME_LEN) : 0;
+
+    // ip address of the server
+    struct sockaddr_in serv_addr{};
+    int ret, enable = 1;
+
+    // UDP listen fd
+    udpfd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(udpfd < 0, "ERROR: Couldn't open UDP fd.\n");
+
+    // TCP listen fd
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    DIE(sockfd < 0, "ERROR: Couldn't open TCP listen fd.\n");
+
+    // Sets a socket bunch of options
+    set_socket_options(sockfd);
+
+    // Every worker binds its own sockets to the same port and the
+    // kernel balances connections and datagrams between them
+    if (broker->nworkers > 1) {
+        ret = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+        DIE(ret < 0, "Reuseport failed");
+        ret = setsockopt(udpfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+        DIE(ret < 0, "Reuseport failed");
+    }
+
+    // io_uring gives up on non blocking sockets instead of waiting
+    // for them, so only epoll gets them non blocking
+    if (!ring) {
+        ret = ioctl(sockfd, FIONBIO, &enable);
+        DIE(ret < 0, "ERROR: ioctl");
+        set_nonblocking(udpfd);
+    }
+
+    // The kernel caps this at net.core.rmem_max, so it's only a hint
+    int rcvbuf = UDP_RCVBUF;
+    ret = setsockopt(udpfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+    DIE(ret < 0, "Rcvbuf failed");
+
+    // No slot holds a message until the first recvmmsg
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_BATCH; i++)
+        batch[i] = nullptr;
+
+    // Fill out server address info
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(portno);
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+
+    // Bind both TCP and UDP sockets
+    ret = bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr));
+    DIE(ret < 0, "ERROR: Couldn't bind.\n");
+
+    ret = bind(udpfd, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr));
+    DIE(ret < 0, "ERROR: Couldn't bind.\n");
+
+    // Listen on the TCP fd
+    ret = listen(sockfd, QUEUE_LEN);
+    DIE(ret < 0, "ERROR: Couldn't listen.\n");
+
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    DIE(wakefd < 0, "eventfd");
+
+    flushfd = -1;
+    if (broker->options.flush_delay > 0) {
+        flushfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        DIE(flushfd < 0, "timerfd_create");
+    }
+
+    handshakefd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    DIE(handshakefd < 0, "timerfd_create");
+    sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    DIE(sparefd < 0, "open /dev/null");
+
+    expirefd = sweepfd = -1;
+    if (broker->options.ttl || !broker->options.ttls.empty()) {
+        expirefd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        DIE(expirefd < 0, "timerfd_create");
+    }
+    if (broker->options.client_quota.messages || broker->options.client_quota.bytes) {
+        sweepfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        DIE(sweepfd < 0, "timerfd_create");
+        set_timer(sweepfd, SF_SWEEP_MS * 1000000ull, true);
+    }
+
+    // With io_uring connections are accepted and datagrams received
+    // into the pool by multishot operations, one submission each.
+    // Kernels without buffer rings receive through the loop instead
+    if (ring) {
+        arm_accept();
+        udp_ring = ring->buf_ring(UDP_RING, UDP_GROUP);
+        if (udp_ring) {
+            for (int i = 0; i < UDP_RING; i++)
+                give_udp_buffer(i);
+            udp_msg = msghdr{};
+            udp_msg.msg_namelen = sizeof(struct sockaddr_in);
+            arm_udp();
+        } else {
+            set_nonblocking(udpfd);
+        }
+    }
+
+    // The sockets are edge triggered, so every handler keeps reading
+    // until the socket would block
+    if (!ring) {
+        ret = loop.add(sockfd, EPOLLIN | EPOLLET);
+        DIE(ret < 0, "epoll_ctl");
+    }
+    if (!udp_ring) {
+        ret = loop.add(udpfd, EPOLLIN | EPOLLET);
+        DIE(ret < 0, "epoll_ctl");
+    }
+    ret = loop.add(wakefd, EPOLLIN);
+    DIE(ret < 0, "epoll_ctl");
+    for (int fd : {handshakefd, flushfd, expirefd, sweepfd}) {
+        if (fd >= 0) {
+            ret = loop.add(fd, EPOLLIN);
+            DIE(ret < 0, "epoll_ctl");
+        }
+    }
+
+    // One mailbox for every other worker
+    mailboxes.resize(broker->nworkers, nullptr);
+    for (int i = 0; i < broker->nworkers; i++) {
+        if (i != index)
+            mailboxes[i] = new Mailbox();
+    }
+    outbox.resize(broker->nworkers);
+
+    // The workers take turns looking after the links to our peers,
+    // which connect once the worker runs
+    const vector<struct sockaddr_in> &peers = broker->options.peers;
+    for (size_t i = index; i < peers.size(); i += broker->nworkers) {
+        struct sockaddr_in peer = peers[i];
+        connection_handlers handlers;
+        handlers.on_packet = [this](const packet *p) { ingest_peer(p); };
+        handlers.on_state = [peer](int state, int reason) {
+            if (state == CONN_READY)
+                printf("Linked to peer %s:%u.\n", inet_ntoa(peer.sin_addr),
+                       ntohs(peer.sin_port));
+            else if (state == CONN_CLOSED && reason == CLOSE_SAME_ID)
+                printf("Peer %s:%u has our node name, not linking to it.\n",
+                       inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+        };
+        links.push_back(new Connection(&loop, PEER_PREFIX + broker->options.node, peer,
+                                       handlers, true));
+    }
+}
+
+Worker::~Worker() {
+    // close remaining fds
+    for (auto client : clients.all) {
+        if (client->status == CLIENT_ONLINE) {
+            shutdown(client->fd, SHUT_RDWR);
+            close(client->fd);
+        }
+    }
+    for (const auto &hs : handshakes)
+        close(hs.first);
+    for (auto link : links)
+        delete link;
+
+    // Nothing may land in the pool anymore once it's gone
+    if (ring) {
+        loop.cancel(sockfd);
+        loop.cancel(udpfd);
+    }
+    close(sockfd);
+    close(udpfd);
+    close(wakefd);
+    if (sparefd >= 0)
+        close(sparefd);
+    for (int fd : {handshakefd, flushfd, expirefd, sweepfd}) {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    for (auto box : mailboxes)
+        delete box;
+
+    // Give back the slots waiting for the next batch
+    for (auto m : batch) {
+        if (m)
+            message_put(m);
+    }
+    if (udp_ring) {
+        for (auto m : udp_bufs) {
+            if (m)
+                message_put(m);
+        }
+    }
+
+    // free memory allocated to clients
+    for (auto client : clients.all) {
+        delete client;
+    }
+    delete store;
+    delete spillover;
+}
+
+// Mail nobody is going to read anymore
+static void discard(const mail &letter) {
+    if (letter.type == MAIL_PUBLISH) {
+        message_put((message *)letter.ptr);
+    } else if (letter.type == MAIL_INTEREST) {
+        delete (interest_update *)letter.ptr;
+    } else {
+        close(((handoff *)letter.ptr)->fd);
+        delete (handoff *)letter.ptr;
+    }
+}
+
+void Worker::release_messages() {
+    mail letter{};
+
+    for (auto box : mailboxes) {
+        while (box && box->pop(letter))
+            discard(letter);
+    }
+    for (auto &letters : outbox) {
+        for (const auto &waiting : letters)
+            discard(waiting);
+        letters.clear();
+    }
+    outboxed = 0;
+
+    // free any packets that were saved but didn't get sent
+    // (client sub to SF, disconnected and never reconnected),
+    // the store keeps them around for the next run instead
+    if (store)
+        store->sync();
+    for (auto client : clients.all) {
+        if (store) {
+            client->backlog.forget();
+            client->unacked.forget();
+        } else {
+            client->backlog.clear();
+            client->unacked.clear();
+        }
+        // Queued frames may be shared with another worker's pool too
+        client->out.clear();
+    }
+    logs.clear();
+}
+
+void Worker::restore() {
+    if (!store)
+        return;
+
+    for (const auto &saved : store->recover()) {
+        auto *client = new Client(CLIENT_DISCONNECTED, saved.id, sockaddr_in{}, 0,
+                                  FRAME_LEGACY, broker->options.out_limit);
+        client->topics = saved.topics;
+        clients.add(client);
+        {
+            lock_guard<mutex> guard(broker->owners_lock);
+            broker->owners[saved.id] = index;
+        }
+
+        for (const auto &topic : saved.topics) {
+            content_filter filter;
+            auto text = saved.filters.find(topic.first);
+            if (text != saved.filters.end() && parse_filter(text->second.c_str(), &filter))
+                add_subscriber(client, topic.first, topic.second, filters.acquire(filter));
+            else
+                add_subscriber(client, topic.first, topic.second);
+
+            // Nobody runs yet, so every worker's interest can be set
+            // directly instead of going through the mailboxes
+            if (topic_map[topic.first].size() == 1) {
+                for (auto worker : broker->workers)
+                    worker->set_interest(topic.first, index, 1);
+            }
+            if (local_subscribers[topic.first] == 1) {
+                for (auto worker : broker->workers)
+                    worker->set_local_interest(topic.first, index, 1);
+            }
+            if (topic.second != 1)
+                continue;
+
+            // Clients that were still connected when we went down
+            // catch up from wherever the log ends now
+            TopicLog *log = log_of(topic.first);
+            uint64_t pos = log->next;
+            bool stored = false;
+            for (const auto &cursor : saved.cursors) {
+                if (cursor.first == topic.first) {
+                    pos = max(log->first, min(cursor.second, log->next));
+                    stored = true;
+                }
+            }
+            if (!stored)
+                store->away(saved.id, topic.first, pos);
+            client->backlog.add(log, pos);
+        }
+    }
+    store->sync();
+}
+
+void Worker::run() {
+    for (auto link : links)
+        link->start();
+
+    while (broker->running.load(memory_order_relaxed)) {
+        // block until one of the file descriptors is active, clients
+        // catching up get their next slice and datagrams left in the
+        // socket get read as soon as the rest had a go. Nobody tells
+        // us when a full mailbox has room again
+        int timeout = -1;
+        if (!slices.empty() || (udp_waiting && !outboxed))
+            timeout = 0;
+        else if (outboxed)
+            timeout = OUTBOX_RETRY_MS;
+        int nready = loop.wait(timeout);
+
+        // check what happened to each one that is ready
+        for (int i = 0; i < nready; i++) {
+            int fd = loop.events[i].data.fd;
+
+            if (fd == wakefd) {
+                // Reset the counter and go through our mail
+                uint64_t count;
+                DIE(read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN,
+                    "read eventfd");
+                handle_mail();
+
+                if (stats_wanted.load(memory_order_relaxed))
+                    report(stats_wanted.exchange(nullptr, memory_order_acquire));
+            } else if (fd == flushfd) {
+                uint64_t count;
+                DIE(read(flushfd, &count, sizeof(count)) < 0 && errno != EAGAIN,
+                    "read timerfd");
+                flush_held();
+            } else if (fd == expirefd || fd == sweepfd || fd == handshakefd) {
+                uint64_t count;
+                DIE(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN,
+                    "read timerfd");
+                if (fd == expirefd)
+                    expire_logs();
+                else if (fd == sweepfd)
+                    sweep_quotas();
+                else
+                    expire_handshakes();
+            } else if (fd == sockfd) {
+                handle_accept();
+            } else if (fd == udpfd) {
+                handle_udp();
+            } else if (handshakes.count(fd)) {
+                handle_handshake(fd);
+            } else if (clients.by_fd(fd)) {
+                handle_client(fd, loop.events[i].events);
+            } else {
+                // Not a client, so it's one of our links to the peers
+                for (auto link : links) {
+                    if (link->handle(fd, loop.events[i].events))
+                        break;
+                }
+            }
+        }
+        if (ring)
+            handle_completions();
+
+        // Mail that waited for room in a mailbox, and the datagrams
+        // that were left in the socket
+        send_outbox();
+        if (!outboxed)
+            resume_udp();
+
+        // Everything queued this round goes out in one write per client
+        flush_dirty();
+        flush_slices();
+
+        // Mail only gets read once the other worker is woken up
+        wake_pending();
+
+        // FSYNC_BATCH: everything appended this round goes to the disk
+        if (store)
+            store->sync();
+    }
+}
+
+// TCP listen active, accept every pending connection
+void Worker::handle_accept() {
+    struct sockaddr_in cli_addr{};
+    socklen_t clilen;
+
+    while (true) {
+        // New client is connecting, accept its connection
+        clilen = sizeof(cli_addr);
+        int newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
+        // A connection that was reset before we got to it is gone
+        if (newsockfd < 0 && (errno == ECONNABORTED || errno == EINTR))
+            continue;
+
+        // The listen socket is edge triggered, whatever is left in the
+        // backlog wouldn't be reported again until the next client
+        // connects. Out of fds, they get closed instead
+        if (newsockfd < 0 && (errno == EMFILE || errno == ENFILE) && refuse_connection())
+            continue;
+        if (newsockfd < 0)
+            break;
+        accept_client(newsockfd, cli_addr, clilen);
+    }
+}
+
+// Out of fds, the spare one makes room to take the first waiting
+// connection off the backlog and close it. False if nothing was waiting
+// or the spare is gone too
+bool Worker::refuse_connection() {
+    if (sparefd < 0)
+        sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (sparefd < 0)
+        return false;
+    close(sparefd);
+
+    // With io_uring the listen socket blocks
+    struct pollfd pending{sockfd, POLLIN, 0};
+    int fd = -1;
+    if (poll(&pending, 1, 0) > 0)
+        fd = accept(sockfd, nullptr, nullptr);
+    if (fd >= 0) {
+        close(fd);
+        metrics.refused++;
+    }
+    sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0;
+}
+
+void Worker::accept_client(int newsockfd, struct sockaddr_in cli_addr, socklen_t clilen) {
+    // Enable socket options
+    set_socket_options(newsockfd);
+
+    // As per protocol, client must send its ID when connecting. The
+    // loop tells us when it arrives, nothing waits for it meanwhile
+    set_nonblocking(newsockfd);
+    int ret = loop.add(newsockfd, EPOLLIN | EPOLLRDHUP | EPOLLET);
+    DIE(ret < 0, "epoll_ctl");
+
+    // It can't keep the fd for good without ever sending anything
+    uint64_t deadline = now_ns() + HANDSHAKE_MS * 1000000ull;
+    handshakes[newsockfd] = handshake{string(), cli_addr, clilen, deadline};
+    if (deadlines.empty())
+        set_timer(handshakefd, deadline);
+    deadlines.push_back({deadline, newsockfd});
+}
+
+// Closes a connection that didn't send its ID line
+void Worker::drop_handshake(int fd) {
+    const handshake &hs = handshakes[fd];
+    printf("Client from %s:%u never sent its ID.\n",
+           inet_ntoa(hs.cli_addr.sin_addr), ntohs(hs.cli_addr.sin_port));
+    loop.remove(fd);
+    close(fd);
+    handshakes.erase(fd);
+}
+
+void Worker::expire_handshakes() {
+    uint64_t now = now_ns();
+    while (!deadlines.empty() && deadlines.front().first <= now) {
+        int fd = deadlines.front().second;
+        deadlines.pop_front();
+
+        // Done with its handshake already. The fd may belong to a newer
+        // connection by now, that one has a later deadline further back
+        auto hs = handshakes.find(fd);
+        if (hs != handshakes.end() && hs->second.deadline <= now)
+            drop_handshake(fd);
+    }
+    if (!deadlines.empty())
+        set_timer(handshakefd, deadlines.front().first);
+}
+
+// A connection that didn't send its whole ID line yet is readable
+void Worker::handle_handshake(int fd) {
+    char buffer[BUFLEN];
+    handshake &hs = handshakes[fd];
+    size_t line;
+
+    while ((line = hs.input.find('\n')) == string::npos) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        // Gone, or it's not sending an ID any time soon
+        if (n <= 0 || hs.input.size() + n > BUFLEN) {
+            drop_handshake(fd);
+            return;
+        }
+        hs.input.append(buffer, n);
+    }
+
+    // From here on the fd is attached or handed over like any other
+    // accepted connection
+    handshake done = move(hs);
+    handshakes.erase(fd);
+    loop.remove(fd);
+
+    // Commands the client sent right behind the ID are run
+    // once it's attached
+    string pending = done.input.substr(line + 1);
+    done.input.resize(line);
+    if (line && done.input[line - 1] == '\r')
+        done.input.resize(line - 1);
+    char *save;
+    char *token = strtok_r(&done.input[0], " ", &save);
+    string id = string(token ? token : "");
+
+    // No version means an old client, so it gets whole packets.
+    // Version 3 clients that got something before add the last
+    // sequence number they saw and the epoch it came from
+    int version = FRAME_LEGACY;
+    uint64_t resume = 0;
+    token = strtok_r(nullptr, " ", &save);
+    if (token && atoi(token) >= FRAME_V2) {
+        version = min(atoi(token), FRAME_VERSION);
+
+        // A sequence number from before a restart means nothing now
+        token = strtok_r(nullptr, " ", &save);
+        char *epoch = strtok_r(nullptr, " ", &save);
+        if (token && epoch && version >= FRAME_V3 &&
+            strtoull(epoch, nullptr, 10) == broker->epoch)
+            resume = strtoull(token, nullptr, 10);
+    }
+
+    // The first worker to see an ID owns that client for good,
+    // when it comes back through another worker the connection
+    // gets handed over to the owner
+    int owner;
+    {
+        lock_guard<mutex> guard(broker->owners_lock);
+        auto entry = broker->owners.find(id);
+        if (entry == broker->owners.end()) {
+            broker->owners[id] = index;
+            owner = index;
+        } else {
+            owner = entry->second;
+        }
+    }
+
+    if (owner == index)
+        attach_client(fd, id, version, resume, pending, done.cli_addr, done.clilen);
+    else
+        post(owner, MAIL_HANDOFF,
+             new handoff{fd, id, version, resume, pending, done.cli_addr, done.clilen});
+}
+
+void Worker::attach_client(int newsockfd, const string &id, int version, uint64_t resume,
+                           const string &pending, struct sockaddr_in cli_addr,
+                           socklen_t clilen) {
+    // We'd be forwarding our own messages back to ourselves
+    if (id == PEER_PREFIX + broker->options.node) {
+        printf("Peer %s has our node name.\n", id.c_str());
+        // It's going away either way, whether it got this or not
+        send_reply(newsockfd, version, "ERRSAMEID");
+        close(newsockfd);
+        return;
+    }
+
+    // A peer only comes back while we think it's still here if the old
+    // link died without us noticing, the new one takes over
+    Client *client = clients.by_id(id);
+    if (client && client->status == CLIENT_ONLINE && client->peer)
+        disconnect(client);
+
+    if (client && client->status == CLIENT_ONLINE) {
+        printf("Client %s already connected.\n", id.c_str());
+
+        // Generate a Server-TCP Client packet with data type REPLY
+        // and drop the connection
+        // It's going away either way, whether it got this or not
+        send_reply(newsockfd, version, "ERRSAMEID");
+        close(newsockfd);
+        return;
+    }
+
+    metrics.connects++;
+    if (client) {
+        // If the Client exists but is away, we update its fd
+        // And we send it what was published on its SF topics meanwhile
+        clients.online(client, newsockfd);
+        client->version = version;
+
+        // Whatever it got before the old connection went down it
+        // doesn't get again. A version 3 client keeps its cursors
+        // until it acknowledges what gets replayed
+        if (resume)
+            client->backlog.skip(resume);
+        if (version >= FRAME_V3) {
+            for (const auto &cursor : client->backlog.cursors)
+                client->unacked.add(cursor.log, max(cursor.pos, cursor.log->first));
+        }
+
+        // The backlog is empty if it never subscribed with SF, otherwise
+        // it catches up like a spilling client: its topic logs merge back
+        // in publish order a slice at a time as its socket takes them,
+        // and whatever gets published meanwhile waits in the logs behind
+        if (!client->backlog.empty()) {
+            for (const auto &topic : client->topics) {
+                if (topic.second != 1) {
+                    TopicLog *log = log_of(topic.first);
+                    client->backlog.add(log, log->next);
+                }
+            }
+            client->spilling = 1;
+            client->replay_start = now_ns();
+            client->replayed = 0;
+            metrics.replays++;
+        } else if (store) {
+            store->back(id);
+        }
+    } else {
+        // No client with this ID ever existed, create new Client instance.
+        // Peers carry a whole node's worth of subscribers
+        size_t limit = broker->options.out_limit;
+        if (id[0] == PEER_PREFIX)
+            limit = max(limit, (size_t)PEER_OUT_LIMIT);
+        client = new Client(newsockfd, id, cli_addr, clilen, version, limit);
+        clients.add(client);
+    }
+
+    // Let the client know which version we settled on, and version 3
+    // clients which run the sequence numbers belong to. It goes out
+    // with the rest of the queue, ahead of anything replayed
+    if (version != FRAME_LEGACY) {
+        packet hello{};
+        hello.data_t = PACKET_HELLO;
+        hello.payload[0] = (char)version;
+        size_t hello_len = 1;
+        if (version >= FRAME_V3) {
+            uint64_t net = htobe64(broker->epoch);
+            memcpy(hello.payload + 1, &net, sizeof(net));
+            hello_len += sizeof(net);
+        }
+
+        char frame[MAX_FRAME_LEN];
+        size_t len;
+        const char *data = wire_bytes(version, &hello, hello_len, frame, &len);
+        send_to(client, data, len);
+    }
+
+    // From now on the client is served by the event loop, EPOLLOUT is
+    // edge triggered too so it only fires once a full socket has room again.
+    // With io_uring a write that didn't fit asks for POLLOUT itself
+
+    // Zerocopy writes are only worth it for big fanouts of big frames,
+    // and only on epoll
+    client->zerocopy = 0;
+    if (broker->options.zerocopy && !ring) {
+        int enable = 1;
+        client->zerocopy = setsockopt(newsockfd, SOL_SOCKET, SO_ZEROCOPY,
+                                      &enable, sizeof(enable)) == 0;
+    }
+
+    uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    int ret = loop.add(newsockfd, ring ? events : events | EPOLLOUT);
+    DIE(ret < 0, "epoll_ctl");
+    if (client->spilling)
+        schedule(client, true);
+
+    // Print to stdout
+    printf("New client %s connected from %s:%u.\n",
+           id.c_str(), inet_ntoa(cli_addr.sin_addr),
+           ntohs(cli_addr.sin_port));
+
+    // A client that didn't wait for the HELLO may have sent its
+    // subscriptions along with the ID
+    client->input = pending;
+    client->discarding = false;
+    handle_input(client);
+}
+
+// UDP fd active, drain every queued datagram a batch at a time
+void Worker::handle_udp() {
+    udp_waiting = false;
+    for (int batches = 0;; batches++) {
+        // Another worker isn't keeping up with what we mail it, the
+        // datagrams wait in the socket until the outbox is empty again.
+        // Our own mail doesn't wait for the socket to run dry either
+        if (outboxed || batches == UDP_BATCHES) {
+            udp_waiting = true;
+            break;
+        }
+
+        // Point the empty slots at fresh messages, recvmmsg writes the
+        // datagram straight into the packet and the sender into cli_addr
+        for (int i = 0; i < UDP_BATCH; i++) {
+            if (!batch[i]) {
+                batch[i] = message_new(&pool);
+                iovecs[i].iov_base = &batch[i]->pkt;
+                iovecs[i].iov_len = DATAGRAM_HEADER_LEN + PAYLOAD_LEN;
+                msgs[i].msg_hdr.msg_iov = &iovecs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &batch[i]->pkt.cli_addr;
+            }
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        int count = recvmmsg(udpfd, msgs, UDP_BATCH, MSG_DONTWAIT, nullptr);
+        if (count < 0) {
+            DIE(errno != EAGAIN && errno != EWOULDBLOCK, "recvmmsg");
+            break;
+        }
+        uint64_t start = now_ns();
+        metrics.datagrams += count;
+
+        for (int i = 0; i < count; i++) {
+            ingest(batch[i], msgs[i].msg_len);
+            batch[i] = nullptr;
+        }
+        metrics.ingest.record(now_ns() - start);
+
+        // A short batch means the socket is empty, new datagrams
+        // trigger a new edge
+        if (count < UDP_BATCH)
+            break;
+    }
+}
+
+void Worker::ingest(message *m, size_t n) {
+    // Without a topic and a data type there's nothing to forward
+    if (n < DATAGRAM_HEADER_LEN) {
+        metrics.malformed++;
+        message_put(m);
+        return;
+    }
+
+    // Only send as much of the payload as the data type needs,
+    // the buffer isn't zeroed so strings get their '\0' here
+    m->payload_len = payload_size(&m->pkt, n - DATAGRAM_HEADER_LEN);
+    if (m->payload_len < PAYLOAD_LEN)
+        m->pkt.payload[m->payload_len] = 0;
+
+    // Encoded here once, before any other worker gets to see it
+    message_encode(m);
+    route(m);
+}
+
+void Worker::ingest_peer(const packet *p) {
+    message *m = message_new(&pool);
+    memcpy(&m->pkt, p, sizeof(packet));
+    m->payload_len = payload_size(p, PAYLOAD_LEN);
+    m->from_peer = 1;
+    metrics.from_peers++;
+
+    message_encode(m);
+    route(m);
+}
+
+void Worker::arm_accept() {
+    struct io_uring_sqe *sqe = ring->sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+void Worker::arm_udp() {
+    // Every datagram lands in one of the buffers we gave the kernel,
+    // header and sender first and then the packet right where it goes
+    struct io_uring_sqe *sqe = ring->sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = udpfd;
+    sqe->addr = (uint64_t)&udp_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UDP_GROUP;
+    sqe->user_data = TAG_UDP;
+}
+
+void Worker::give_udp_buffer(uint16_t bid) {
+    message *m = message_new(&pool);
+    udp_bufs[bid] = m;
+    ring->buf_add(udp_ring, UDP_RING, m->recv_header,
+                  RECV_HEADER_LEN + DATAGRAM_HEADER_LEN + PAYLOAD_LEN, bid);
+}
+
+void Worker::udp_received(const completion &c) {
+    if (c.flags & IORING_CQE_F_BUFFER) {
+        auto bid = (uint16_t)(c.flags >> IORING_CQE_BUFFER_SHIFT);
+        message *m = udp_bufs[bid];
+
+        // Another worker isn't keeping up with what we mail it, so the
+        // kernel gets no new buffers to receive into
+        if (outboxed) {
+            udp_bufs[bid] = nullptr;
+            udp_held.push_back(bid);
+        } else {
+            give_udp_buffer(bid);
+        }
+
+        if (c.res < 0) {
+            message_put(m);
+        } else {
+            auto out = (struct io_uring_recvmsg_out *)m->recv_header;
+            memcpy(&m->pkt.cli_addr, m->recv_header + sizeof(*out),
+                   sizeof(struct sockaddr_in));
+
+            metrics.datagrams++;
+            ingest(m, min((size_t)out->payloadlen,
+                          (size_t)(DATAGRAM_HEADER_LEN + PAYLOAD_LEN)));
+        }
+    }
+
+    // Out of buffers or the kernel gave up for some other reason.
+    // With buffers held back it starts again once they're returned
+    if (!(c.flags & IORING_CQE_F_MORE) && c.res != -ECANCELED) {
+        if (udp_held.empty())
+            arm_udp();
+        else
+            udp_waiting = true;
+    }
+}
+
+void Worker::send_async(Client *client) {
+    if (client->sending)
+        return;
+
+    client->send_msg = msghdr{};
+    client->send_msg.msg_iov = client->send_iov;
+    client->send_msg.msg_iovlen = client->out.start_send(client->send_iov);
+
+    // Goes out with everything else at the next wait
+    struct io_uring_sqe *sqe = ring->sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->fd;
+    sqe->addr = (uint64_t)&client->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = TAG_SEND | (uint64_t)client;
+    client->sending = 1;
+    metrics.writes++;
+}
+
+void Worker::sent(Client *client, int res) {
+    client->sending = 0;
+
+    // The connection this was for is gone, the queue was cleared
+    if (client->send_stale) {
+        client->send_stale = 0;
+        flush(client);
+        return;
+    }
+
+    if (res == -EAGAIN) {
+        // Try again once the socket has room
+        client->out.finish_send(0);
+        struct io_uring_sqe *sqe = ring->sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = client->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = TAG_WRITABLE | (uint64_t)client;
+        return;
+    }
+    if (res < 0) {
+        // A broken connection only takes down its own client
+        client->out.finish_send(0);
+        disconnect(client);
+        return;
+    }
+
+    client->out.finish_send(res);
+    flush(client);
+}
+
+void Worker::handle_completions() {
+    uint64_t start = now_ns();
+    bool received = false;
+
+    for (int i = 0; i < loop.ncompletions; i++) {
+        const completion &c = loop.completions[i];
+        auto client = (Client *)(c.tag & ~TAG_KIND);
+
+        switch (c.tag & TAG_KIND) {
+            case TAG_ACCEPT:
+                if (c.res >= 0) {
+                    struct sockaddr_in cli_addr{};
+                    socklen_t clilen = sizeof(cli_addr);
+                    getpeername(c.res, (struct sockaddr *)&cli_addr, &clilen);
+                    accept_client(c.res, cli_addr, clilen);
+                } else if (c.res == -EMFILE || c.res == -ENFILE) {
+                    refuse_connection();
+                }
+                if (!(c.flags & IORING_CQE_F_MORE) && c.res != -ECANCELED)
+                    arm_accept();
+                break;
+            case TAG_UDP:
+                udp_received(c);
+                received = true;
+                break;
+            case TAG_SEND:
+                sent(client, c.res);
+                break;
+            case TAG_WRITABLE:
+                if (c.res > 0 && client->status == CLIENT_ONLINE)
+                    flush(client);
+                break;
+        }
+    }
+
+    if (received)
+        metrics.ingest.record(now_ns() - start);
+}
+
+// Hands the message to every worker that has subscribers for it,
+// each one holds its own reference until it's done. Drops ours.
+void Worker::route(message *m) {
+    uint32_t topic = topic_id(&m->pkt);
+    routes[topic].messages++;
+    routes[topic].bytes += m->payload_len;
+
+    uint64_t workers = workers_for(topic);
+    for (int w = 0; workers; w++, workers >>= 1) {
+        if (!(workers & 1))
+            continue;
+        if (w == index) {
+            deliver(m, topic);
+        } else {
+            message_get(m);
+            post(w, MAIL_PUBLISH, m);
+            metrics.mailed++;
+        }
+    }
+    message_put(m);
+}
+
+uint32_t Worker::topic_id(const packet *p) {
+    uint32_t id = topics.intern(p->topic, strnlen(p->topic, TOPIC_LEN));
+    if (id == routes.size()) {
+        routes.push_back(topic_route{});
+        if (!retain_patterns.empty()) {
+            vector<const string *> matched;
+            retain_patterns.match(topics.name(id), matched);
+            routes[id].retain = !matched.empty();
+        }
+    }
+    return id;
+}
+
+uint64_t Worker::workers_for(uint32_t topic) {
+    topic_route &route = routes[topic];
+    if (route.workers_gen == interest_gen)
+        return route.workers;
+
+    vector<const string *> matched;
+    interest_patterns.match(topics.name(topic), matched);
+    route.workers = 0;
+    for (auto pattern : matched)
+        route.workers |= interest[*pattern];
+
+    // Every worker keeps its own copy of retained topics
+    if (route.retain)
+        route.workers = broker->nworkers == 64 ? ~0ull : (1ull << broker->nworkers) - 1;
+    route.workers_gen = interest_gen;
+    return route.workers;
+}
+
+const topic_route &Worker::resolve(uint32_t topic) {
+    topic_route &route = routes[topic];
+    if (route.subscribers_gen == subscribers_gen)
+        return route;
+
+    route.subscribers.clear();
+    route.logs.clear();
+    vector<const string *> matched;
+    patterns.match(topics.name(topic), matched);
+    for (auto pattern : matched) {
+        route.logs.push_back(log_of(*pattern));
+        const vector<subscriber> &subscribers = topic_map[*pattern];
+        route.subscribers.insert(route.subscribers.end(), subscribers.begin(),
+                                 subscribers.end());
+    }
+
+    // A client with overlapping patterns still gets every message once,
+    // and counts as store and forward if any of them is. If they filter
+    // differently it isn't filtered at all, so nothing either of them
+    // lets through goes missing
+    sort(route.subscribers.begin(), route.subscribers.end(),
+         [](const subscriber &a, const subscriber &b) { return a.client < b.client; });
+    size_t kept = 0;
+    for (const auto &entry : route.subscribers) {
+        if (kept && route.subscribers[kept - 1].client == entry.client) {
+            subscriber &merged = route.subscribers[kept - 1];
+            merged.sf |= entry.sf;
+            if (merged.filter != entry.filter)
+                merged.filter = FILTER_NONE;
+        } else {
+            route.subscribers[kept++] = entry;
+        }
+    }
+    route.subscribers.resize(kept);
+    route.subscribers_gen = subscribers_gen;
+    return route;
+}
+
+// Forwards a message to all local subscribers of its topic
+void Worker::deliver(message *m, uint32_t topic) {
+    if (routes[topic].retain)
+        retained.put(topic, m->frame, m->frame_len);
+
+    // Every client whose patterns match the topic
+    const topic_route &route = resolve(topic);
+    if (route.subscribers.empty())
+        return;
+    uint64_t start = now_ns();
+
+    // Clients that are away with SF or spilling read it from the logs,
+    // the entry has the same order in all of them so a client reading
+    // several of them gets it once
+    uint64_t order = ++published;
+    for (auto log : route.logs) {
+        if (log->wanted())
+            log_append(log, m, order);
+    }
+
+    // Forward packet to all subscribers of the given topic, their
+    // queues share the message's bytes instead of copying them
+    message *sequenced = nullptr;
+    for (const auto &entry : route.subscribers) {
+        Client *client = entry.client;
+
+        // Disconnected and spilling clients already have it in the log
+        if (client->status != CLIENT_ONLINE || client->spilling)
+            continue;
+
+        // Every broker sends what it got from a publisher to all the
+        // peers that want it, so nothing goes further than one hop
+        if (m->from_peer && client->peer)
+            continue;
+
+        // Subscribers sharing a filter share its verdict, every
+        // predicate is tested once per message
+        if (entry.filter != FILTER_NONE && !filters.passes(entry.filter, m, topic, order)) {
+            metrics.filtered++;
+            continue;
+        }
+
+        // Version 3 clients get the order as the sequence number of
+        // store and forward messages. The order is the same for all of
+        // them, so the sequenced frame is encoded once and shared too
+        size_t len;
+        bool queued;
+        if (entry.sf && client->version >= FRAME_V3) {
+            if (!sequenced) {
+                sequenced = message_new(&pool);
+                sequenced->frame_len = sequence_frame(sequenced->frame, m->frame,
+                                                      m->frame_len, order);
+            }
+            len = sequenced->frame_len;
+            queued = send_to(client, sequenced->frame, len, sequenced);
+        } else {
+            const char *data = message_wire(m, client->version, &len);
+            queued = send_to(client, data, len, m);
+        }
+
+        // The client starts spilling, its backlog begins with this message
+        if (!queued) {
+            spill(client, m, order);
+            flush(client);
+            continue;
+        }
+        metrics.deliveries++;
+        metrics.delivered_bytes += len;
+        if (client->peer)
+            metrics.to_peers++;
+    }
+    if (sequenced)
+        message_put(sequenced);
+    metrics.fanout.record(now_ns() - start);
+}
+
+bool Worker::send_to(Client *client, const char *data, size_t len, message *m) {
+    OutQueue &out = client->out;
+    bool queued = m ? out.push_ref(m, data, len) : out.push(data, len);
+
+    // The queue may only be full because it's waiting for its write
+    if (!queued && client->pending != FLUSH_NONE) {
+        flush(client);
+        if (client->status != CLIENT_ONLINE)
+            return true;
+        queued = m ? out.push_ref(m, data, len) : out.push(data, len);
+    }
+
+    if (!queued) {
+        // The client can't keep up, apply the overflow policy. Peers
+        // lose the oldest frames, they have no store and forward here
+        switch (client->peer ? OVERFLOW_DROP : broker->options.overflow) {
+            case OVERFLOW_DROP: {
+                // If not even dropping makes room, the new frame is dropped
+                int dropped = client->out.drop_oldest(len);
+                if (dropped < 0) {
+                    metrics.dropped++;
+                    return true;
+                }
+                metrics.dropped += dropped;
+                m ? out.push_ref(m, data, len) : out.push(data, len);
+                break;
+            }
+            case OVERFLOW_DISCONNECT:
+                printf("Client %s is too slow.\n", client->id.c_str());
+                metrics.kicked++;
+                disconnect(client);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Replies don't wait for the flush delay
+    schedule(client, !m);
+    return true;
+}
+
+// Generates a Server->Client packet with data type REPLY and queues it
+// behind everything else that goes to the client
+void Worker::reply(Client *client, const char *text) {
+    // A spilling client gets it once there's room again
+    if (client->spilling) {
+        client->replies.emplace_back(text);
+        return;
+    }
+
+    packet reply{};
+    reply.data_t = PACKET_REPLY;
+    strcpy(reply.payload, text);
+
+    char frame[MAX_FRAME_LEN];
+    size_t len;
+    const char *data = wire_bytes(client->version, &reply, strlen(text), frame, &len);
+    if (!send_to(client, data, len)) {
+        client->replies.emplace_back(text);
+        spill(client, nullptr, 0);
+        flush(client);
+    }
+}
+
+void Worker::send_retained(Client *client, const string &pattern, uint32_t filter) {
+    // A spilling client reads what's new from the logs, the
+    // snapshot would land ahead of its backlog
+    if (retained.count() == 0 || client->spilling)
+        return;
+
+    vector<uint32_t> matched;
+    if (topic_is_exact(pattern)) {
+        uint32_t id = topics.find(pattern);
+        if (id != TOPIC_NONE)
+            matched.push_back(id);
+    } else {
+        retained.each([&](uint32_t id) {
+            if (topic_matches(pattern, topics.name(id)))
+                matched.push_back(id);
+        });
+    }
+
+    char buffer[MAX_WIRE_LEN];
+    size_t len;
+    for (uint32_t id : matched) {
+        if (filter != FILTER_NONE) {
+            const char *frame = retained.get(id, &len);
+            packet p;
+            int payload_len = frame ? decode_frame(frame, len, &p) : -1;
+            double value = 0;
+            bool numeric = payload_len >= 0 && packet_number(&p, payload_len, &value);
+            if (!filters.test(filter, numeric, value))
+                continue;
+        }
+        const char *data = retained.wire(id, client->version, buffer, &len);
+        if (data && (!send_to(client, data, len) || client->status != CLIENT_ONLINE))
+            break;
+    }
+}
+
+void Worker::flush(Client *client) {
+    bool sliced = false;
+    while (client->status == CLIENT_ONLINE) {
+        // Logged packets move back into the queue once there's room,
+        // one slice of them per round so a long backlog doesn't hold
+        // up everybody else
+        if (client->spilling && sliced) {
+            if (client->pending != FLUSH_ROUND && client->pending != FLUSH_SLICE) {
+                client->pending = FLUSH_SLICE;
+                slices.push_back(client);
+            }
+            return;
+        }
+        if (client->spilling) {
+            unspill(client);
+            sliced = true;
+        }
+        if (client->out.empty())
+            return;
+
+        // The write finishes later and comes back through sent()
+        if (ring) {
+            send_async(client);
+            return;
+        }
+
+        ssize_t n = client->out.flush(client->fd, client->zerocopy);
+        metrics.writes++;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0) {
+            // A broken connection only takes down its own client
+            disconnect(client);
+            return;
+        }
+
+        // The socket is full, EPOLLOUT brings us back here
+        if (!client->out.empty())
+            return;
+    }
+}
+
+void Worker::schedule(Client *client, bool urgent) {
+    if (client->pending == FLUSH_ROUND)
+        return;
+
+    // Waiting only pays off until a write's worth is queued
+    if (urgent || flushfd < 0 || client->out.size() >= FLUSH_BYTES) {
+        client->pending = FLUSH_ROUND;
+        dirty.push_back(client);
+        return;
+    }
+    if (client->pending == FLUSH_HELD)
+        return;
+
+    // The first client to wait starts the clock for all of them
+    if (held.empty()) {
+        struct itimerspec when{};
+        when.it_value.tv_sec = broker->options.flush_delay / 1000000;
+        when.it_value.tv_nsec = broker->options.flush_delay % 1000000 * 1000;
+        DIE(timerfd_settime(flushfd, 0, &when, nullptr) < 0, "timerfd_settime");
+    }
+    client->pending = FLUSH_HELD;
+    held.push_back(client);
+}
+
+void Worker::flush_dirty() {
+    // Flushing can't add to the list, only unspill() queues more
+    for (auto client : dirty) {
+        if (client->pending != FLUSH_ROUND)
+            continue;
+        client->pending = FLUSH_NONE;
+        flush(client);
+    }
+    dirty.clear();
+}
+
+void Worker::flush_slices() {
+    // Clients that run out of their slice again go on a fresh list
+    vector<Client *> now;
+    now.swap(slices);
+    for (auto client : now) {
+        if (client->pending != FLUSH_SLICE)
+            continue;
+        client->pending = FLUSH_NONE;
+        flush(client);
+    }
+}
+
+void Worker::flush_held() {
+    // Clients that got promoted to this round since are already done
+    for (auto client : held) {
+        if (client->pending != FLUSH_HELD)
+            continue;
+        client->pending = FLUSH_NONE;
+        flush(client);
+    }
+    held.clear();
+}
+
+TopicLog *Worker::log_of(const string &topic) {
+    auto entry = logs.find(topic);
+    if (entry != logs.end())
+        return &entry->second;
+
+    // Every pattern that matches a published topic gets a log, most
+    // never hold anything. Segment files only come about with the first
+    // entry (log_append()) unless there are some left from the last run
+    SegmentLog *disk = store && store->has_log(topic) ? store->open_log(topic) : nullptr;
+    auto ttl = broker->options.ttls.find(topic);
+    entry = logs.emplace(piecewise_construct, forward_as_tuple(topic),
+                         forward_as_tuple(topic, disk, &space,
+                                          ttl != broker->options.ttls.end()
+                                              ? ttl->second : broker->options.ttl)).first;
+    TopicLog *log = &entry->second;
+
+    // Orders keep growing across restarts so stored
+    // entries still merge in publish order
+    if (disk)
+        published = max(published, disk->last_order());
+    if (log->ttl)
+        arm_expiry(log);
+    return log;
+}
+
+bool Worker::log_append(TopicLog *log, message *m, uint64_t order) {
+    int policy = broker->options.sf_overflow;
+    if (policy == SF_DROP_NEWEST && over(quota, space.messages + 1, space.bytes + m->frame_len)) {
+        metrics.sf_dropped++;
+        return false;
+    }
+
+    if (store && !log->disk)
+        log->disk = store->open_log(log->topic);
+    log->append(m, order);
+    metrics.logged++;
+    if (log->ttl)
+        arm_expiry(log);
+
+    // The oldest entries of every log make room
+    while (over(quota, space.messages, space.bytes)) {
+        TopicLog *oldest = space.oldest();
+        if (!oldest)
+            break;
+        if (policy == SF_SPILL) {
+            if (!oldest->spill_oldest(spillover))
+                break;
+            metrics.sf_spilled++;
+        } else {
+            uint64_t dropped = oldest->drop_oldest();
+            if (!dropped)
+                break;
+            metrics.sf_dropped += dropped;
+        }
+    }
+    return true;
+}
+
+void Worker::arm_expiry(TopicLog *log) {
+    if (log->expiring)
+        return;
+    uint64_t when = log->expires();
+    if (!when)
+        return;
+
+    // Only a log that runs out first moves the timer
+    if (expiries.empty() || when < expiries.top().first)
+        set_timer(expirefd, when);
+    log->expiring = true;
+    expiries.push({when, log});
+}
+
+void Worker::expire_logs() {
+    // A log's deadline only ever moves later, so one that was
+    // read meanwhile just goes back on the heap with its new one
+    uint64_t now = now_ns();
+    while (!expiries.empty() && expiries.top().first <= now) {
+        TopicLog *log = expiries.top().second;
+        expiries.pop();
+        metrics.sf_expired += log->expire(now);
+
+        log->expiring = false;
+        if (uint64_t when = log->expires()) {
+            log->expiring = true;
+            expiries.push({when, log});
+        }
+    }
+    if (!expiries.empty())
+        set_timer(expirefd, expiries.top().first);
+}
+
+void Worker::enforce_quota(Client *client) {
+    const sf_quota &limit = broker->options.client_quota;
+    Backlog &backlog = client->backlog;
+    uint64_t messages, bytes;
+    backlog.held(&messages, &bytes);
+    if (!over(limit, messages, bytes))
+        return;
+
+    switch (broker->options.sf_overflow) {
+        case SF_DROP_OLDEST:
+            while (over(limit, messages, bytes)) {
+                log_cursor *cursor = backlog.oldest();
+                if (!cursor)
+                    break;
+                backlog.advance(cursor);
+                metrics.sf_dropped++;
+                backlog.held(&messages, &bytes);
+            }
+            break;
+        case SF_DROP_NEWEST:
+            // The client gets nothing published from now on, and
+            // loses the newest of what it has until it fits
+            backlog.freeze();
+            while (over(limit, messages, bytes) && backlog.drop_newest()) {
+                metrics.sf_dropped++;
+                backlog.held(&messages, &bytes);
+            }
+            break;
+        case SF_SPILL:
+            // Logs spill oldest first, other clients' entries
+            // may have to go before its own
+            while (over(limit, messages, bytes)) {
+                TopicLog *log = nullptr;
+                for (const auto &cursor : backlog.cursors) {
+                    TopicLog *other = cursor.log;
+                    if (max(cursor.pos, other->held_first()) >= Backlog::stop(cursor))
+                        continue;
+                    if (!log || other->order_at(other->held_first()) <
+                                log->order_at(log->held_first()))
+                        log = other;
+                }
+                if (!log || !log->spill_oldest(spillover))
+                    break;
+                metrics.sf_spilled++;
+                backlog.held(&messages, &bytes);
+            }
+            break;
+    }
+}
+
+void Worker::sweep_quotas() {
+    for (auto client : clients.all) {
+        if (!client->backlog.empty())
+            enforce_quota(client);
+    }
+}
+
+void Worker::spill(Client *client, message *m, uint64_t order) {
+    client->spilling = 1;
+    metrics.spills++;
+    string topic = m ? topic_of(&m->pkt) : string();
+
+    for (const auto &pattern : client->topics) {
+        TopicLog *log = log_of(pattern.first);
+        if (!m || !topic_matches(pattern.first, topic)) {
+            client->backlog.add(log, log->next);
+            continue;
+        }
+
+        // Logs nobody was reading didn't keep m, and with
+        // SF_DROP_NEWEST they may have no room for it
+        if (log->last_order() != order && !log_append(log, m, order)) {
+            client->backlog.add(log, log->next);
+            continue;
+        }
+        client->backlog.add(log, log->next - 1);
+    }
+}
+
+// Moves logged packets back into the output queue, oldest first, until
+// it's full or REPLAY_SLICE bytes went in, and stops spilling once the
+// client caught up
+void Worker::unspill(Client *client) {
+    char frame[MAX_WIRE_LEN];
+    size_t len;
+
+    while (!client->replies.empty()) {
+        packet reply{};
+        reply.data_t = PACKET_REPLY;
+        strcpy(reply.payload, client->replies.front().c_str());
+
+        const char *data = wire_bytes(client->version, &reply,
+                                      client->replies.front().size(), frame, &len);
+        if (!client->out.push(data, len))
+            return;
+        client->replies.pop_front();
+    }
+
+    size_t moved = 0;
+    log_cursor *cursor;
+    while (moved < REPLAY_SLICE && (cursor = client->backlog.oldest())) {
+        const char *data = cursor->log->wire_at(cursor->pos, client->version,
+                                                frame, &len);
+
+        // What its filters keep out of the live stream stays out of
+        // what it catches up on. Skipping still counts for the slice
+        if (!client->filters.empty() && !log_passes(client, cursor->log, cursor->pos)) {
+            client->backlog.advance(cursor);
+            moved += len;
+            metrics.filtered++;
+            continue;
+        }
+        message *m = client->version == FRAME_V2 ? cursor->log->message_at(cursor->pos)
+                                                  : nullptr;
+        if (!(m ? client->out.push_ref(m, data, len) : client->out.push(data, len)))
+            return;
+        client->backlog.advance(cursor);
+        moved += len;
+        if (client->replay_start) {
+            client->replayed++;
+            metrics.replayed_bytes += len;
+        }
+    }
+    if (moved >= REPLAY_SLICE)
+        return;
+
+    client->backlog.clear();
+    client->spilling = 0;
+
+    // A reconnect caught up, the store can forget where it was
+    if (client->replay_start) {
+        metrics.replay.record(now_ns() - client->replay_start);
+        client->replay_start = 0;
+        if (store) {
+            store->back(client->id);
+            for (const auto &cursor : client->unacked.cursors)
+                store->away(client->id, cursor.log->topic, cursor.pos);
+        }
+    }
+}
+
+bool Worker::log_passes(Client *client, TopicLog *log, uint64_t pos) {
+    bool numeric;
+    double value = 0;
+    string topic;
+    if (message *m = log->message_at(pos)) {
+        numeric = m->numeric;
+        value = m->value;
+        topic = topic_of(&m->pkt);
+    } else {
+        char buffer[MAX_WIRE_LEN];
+        size_t len;
+        packet p{};
+        const char *frame = log->wire_at(pos, FRAME_V2, buffer, &len);
+        int payload_len = decode_frame(frame, len, &p);
+        numeric = payload_len >= 0 && packet_number(&p, payload_len, &value);
+        topic = topic_of(&p);
+    }
+
+    // Same as resolve(), patterns of the topic that filter differently
+    // let everything through
+    uint32_t filter = FILTER_NONE;
+    bool matched = false;
+    for (const auto &pattern : client->topics) {
+        if (!topic_matches(pattern.first, topic))
+            continue;
+        auto entry = client->filters.find(pattern.first);
+        uint32_t id = entry == client->filters.end() ? FILTER_NONE : entry->second;
+        if (matched && id != filter)
+            return true;
+        filter = id;
+        matched = true;
+    }
+
+    // FILTER_CHANGE has nothing to compare the logged values with
+    // and lets them all through, like it does retained ones
+    return filter == FILTER_NONE || filters.test(filter, numeric, value);
+}
+
+void Worker::disconnect(Client *client) {
+    printf("Client %s disconnected.\n", client->id.c_str());
+    metrics.disconnects++;
+
+    // Closing the fd drops it from epoll, io_uring has to be told.
+    // A write still going finishes on the closed connection
+    loop.remove(client->fd);
+    if (client->sending)
+        client->send_stale = 1;
+    close(client->fd);
+
+    // mark the client as away, since clients are pointers
+    // this will update clients in topic_map as well
+    clients.away(client);
+    client->out.clear();
+    client->replies.clear();
+    if (client->peer)
+        forget_topics(client);
+
+    // While the client is away only the SF topics keep a cursor in
+    // their log, a spilling client keeps its place in them
+    vector<TopicLog *> unwanted;
+    for (const auto &cursor : client->backlog.cursors) {
+        auto topic = client->topics.find(cursor.log->topic);
+        if (topic == client->topics.end() || topic->second != 1)
+            unwanted.push_back(cursor.log);
+    }
+    for (auto log : unwanted)
+        client->backlog.remove(log);
+
+    if (!client->spilling) {
+        for (const auto &topic : client->topics) {
+            if (topic.second == 1) {
+                TopicLog *log = log_of(topic.first);
+                client->backlog.add(log, log->next);
+            }
+        }
+    }
+    client->spilling = 0;
+    client->replay_start = 0;
+
+    // A version 3 client gets back whatever it hadn't acknowledged,
+    // it may never have made it there
+    for (const auto &cursor : client->unacked.cursors) {
+        bool behind = true;
+        for (const auto &away : client->backlog.cursors) {
+            if (away.log == cursor.log)
+                behind = cursor.pos < away.pos;
+        }
+        if (behind) {
+            client->backlog.remove(cursor.log);
+            client->backlog.add(cursor.log, cursor.pos);
+        }
+    }
+    client->unacked.clear();
+
+    // Where the client left off has to survive a restart too
+    if (store) {
+        for (const auto &cursor : client->backlog.cursors)
+            store->away(client->id, cursor.log->topic, cursor.pos);
+    }
+}
+
+// One of our TCP Clients is readable or writable
+void Worker::handle_client(int fd, uint32_t events) {
+    char buffer[BUFLEN];
+    ssize_t n;
+
+    // The client may have been dropped earlier in this round
+    Client *client = clients.by_fd(fd);
+    if (!client)
+        return;
+
+    // The kernel is done with some zerocopy writes. If it had to copy
+    // them anyway (loopback always does) they just cost us the pinning
+    if ((events & EPOLLERR) && client->out.pinned()) {
+        bool copied = false;
+        metrics.zerocopy += client->out.reap(fd, &copied);
+        if (copied)
+            client->zerocopy = 0;
+    }
+
+    // Room in the socket again, keep writing
+    if (events & EPOLLOUT)
+        flush(client);
+
+    // Keep reading commands until the socket runs dry
+    while (client->status == CLIENT_ONLINE) {
+        n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        // Connection closed, a broken one only takes down its own client
+        if (n <= 0) {
+            disconnect(client);
+            break;
+        }
+
+        client->input.append(buffer, n);
+        handle_input(client);
+    }
+}
+
+// Commands end with '\n' and can arrive several at a time or split
+// between reads, so every complete one gets handled
+void Worker::handle_input(Client *client) {
+    size_t start = 0, end;
+    if (client->discarding) {
+        end = client->input.find('\n');
+        if (end == string::npos) {
+            client->input.clear();
+            return;
+        }
+        client->discarding = false;
+        start = end + 1;
+    }
+    while (client->status == CLIENT_ONLINE &&
+           (end = client->input.find('\n', start)) != string::npos) {
+        client->input[end] = 0;
+        if (end > start && client->input[end - 1] == '\r')
+            client->input[end - 1] = 0;
+        handle_command(client, &client->input[start]);
+        start = end + 1;
+    }
+    client->input.erase(0, start);
+
+    // Nobody sends commands this long, don't keep waiting for the end.
+    // What's left of it isn't a command of its own either
+    if (client->input.size() > COMMAND_LEN) {
+        client->input.clear();
+        client->discarding = true;
+    }
+}
+
+// Runs a single command, line is the command without its '\n'. Every
+// worker parses commands at the same time, so no plain strtok
+void Worker::handle_command(Client *client, char *line) {
+    char *save;
+    char *token = strtok_r(line, " ", &save);
+    if (!token)
+        return;
+
+    // A version 3 client got every store and forward message up to
+    // the sequence number, the logs can let go of them
+    if (!strcmp(token, "ack")) {
+        token = strtok_r(nullptr, " ", &save);
+        if (!token || !client->unacked.skip(strtoull(token, nullptr, 10)))
+            return;
+        metrics.acks++;
+        if (store) {
+            for (const auto &cursor : client->unacked.cursors)
+                store->away(client->id, cursor.log->topic, cursor.pos);
+        }
+        return;
+    }
+
+    // Batch forms, "msubscribe TOPIC SF [TOPIC SF]..." and
+    // "munsubscribe TOPIC [TOPIC]...", get a single reply for every
+    // topic in them so a client with hundreds of topics needs one
+    // round trip. Filters only go with a plain subscribe
+    if (!strcmp(token, "msubscribe")) {
+        vector<string> added;
+        size_t count = 0;
+        while ((token = strtok_r(nullptr, " ", &save))) {
+            string topic = string(token);
+            int option = sf_option(strtok_r(nullptr, " ", &save));
+            if (option < 0)
+                continue;
+
+            count++;
+            if (!client->topics.count(topic)) {
+                subscribe(client, topic, option, FILTER_NONE);
+                added.push_back(topic);
+            }
+        }
+
+        char text[64];
+        snprintf(text, sizeof(text), "Subscribed to %zu topics.\n", count);
+        reply(client, text);
+        if (!client->peer) {
+            for (const auto &topic : added)
+                send_retained(client, topic, FILTER_NONE);
+        }
+        return;
+    }
+
+    if (!strcmp(token, "munsubscribe")) {
+        size_t count = 0;
+        while ((token = strtok_r(nullptr, " ", &save))) {
+            string topic = string(token);
+            count++;
+            if (client->topics.count(topic))
+                unsubscribe(client, topic);
+        }
+
+        char text[64];
+        snprintf(text, sizeof(text), "Unsubscribed from %zu topics.\n", count);
+        reply(client, text);
+        return;
+    }
+
+    if (!strcmp(token, "subscribe")) {
+        // Get the topic and the option from the command, whoever
+        // sends something else only hears about it
+        token = strtok_r(nullptr, " ", &save);
+        int option = sf_option(strtok_r(nullptr, " ", &save));
+        if (!token || option < 0) {
+            reply(client, "Bad subscribe, not subscribed.\n");
+            return;
+        }
+        string topic = string(token);
+
+        // usually we would also notify the client it is already
+        // subscribed, but it's not part of the assignment
+        if (client->topics.count(topic))
+            return;
+
+        // Whatever follows the option is a content filter
+        uint32_t filter = FILTER_NONE;
+        content_filter predicate;
+        char *rest = strtok_r(nullptr, "", &save);
+        if (rest && rest[strspn(rest, " ")]) {
+            if (!parse_filter(rest, &predicate)) {
+                reply(client, "Bad filter, not subscribed.\n");
+                return;
+            }
+            filter = filters.acquire(predicate);
+        }
+        subscribe(client, topic, option, filter);
+
+        // Generate new Server->Client Reply, notifying that the operation
+        // was successful then send the packet. A peer would hand the
+        // retained messages to subscribers that already had them
+        reply(client, "Subscribed to topic.\n");
+        if (!client->peer)
+            send_retained(client, topic, filter);
+        return;
+    }
+
+    // Unsubscribe command
+    if (!strcmp(token, "unsubscribe")) {
+        // Get the topic from the command
+        token = strtok_r(nullptr, " ", &save);
+        if (!token) {
+            reply(client, "Bad unsubscribe, no topic.\n");
+            return;
+        }
+        string topic = string(token);
+
+        // If not subscribed, nothing to do here
+        if (!client->topics.count(topic))
+            return;
+        unsubscribe(client, topic);
+
+        // Notify client with a REPLY that the operation
+        // was successful and is unsubscribed
+        reply(client, "Unsubscribed from topic.\n");
+    }
+}
+
+void Worker::subscribe(Client *client, const string &topic, int option, uint32_t filter) {
+    // Peers forget what they asked for when they go away,
+    // so they never get store and forward
+    if (client->peer)
+        option = 0;
+
+    // Add the topic to the client's list of topics with the
+    // specified option
+    client->topics.insert(make_pair(topic, option));
+
+    // Add the client to the list of subscribers on this topic,
+    // wildcard patterns are kept the same way as plain topics
+    add_subscriber(client, topic, option, filter);
+    if (store && !client->peer)
+        store->subscribed(client->id, topic, option,
+                          filter == FILTER_NONE ? "" : filter_text(filters.get(filter)));
+
+    // A spilling client reads the new topic from its log too
+    if (client->spilling) {
+        TopicLog *log = log_of(topic);
+        client->backlog.add(log, log->next);
+    }
+
+    // The log keeps what a version 3 client gets until it
+    // acknowledges it
+    if (option == 1 && client->version >= FRAME_V3) {
+        TopicLog *log = log_of(topic);
+        client->unacked.add(log, log->next);
+    }
+
+    // First local subscriber, ingest has to start sending us this topic
+    if (topic_map[topic].size() == 1)
+        announce_interest(topic, 1);
+
+    // First one that isn't another broker, our peers have to start
+    // sending it to us as well
+    if (!client->peer && local_subscribers[topic] == 1)
+        announce_interest(topic, 1, 1);
+}
+
+void Worker::unsubscribe(Client *client, const string &topic) {
+    // Remove the client from the list of subscribers on this topic
+    remove_subscriber(client, topic);
+
+    // Remove this topic from the client's list of topics
+    client->topics.erase(topic);
+    if (store && !client->peer)
+        store->unsubscribed(client->id, topic);
+    if (client->spilling)
+        client->backlog.remove(log_of(topic));
+    auto log = logs.find(topic);
+    if (log != logs.end())
+        client->unacked.remove(&log->second);
+
+    // Nobody here wants the topic anymore
+    if (!topic_map.count(topic))
+        announce_interest(topic, 0);
+    if (!client->peer && !local_subscribers.count(topic))
+        announce_interest(topic, 0, 1);
+}
+
+// Goes through everything the other workers left for us
+void Worker::handle_mail() {
+    mail letter{};
+
+    for (auto box : mailboxes) {
+        while (box && box->pop(letter)) {
+            if (letter.type == MAIL_PUBLISH) {
+                auto *m = (message *)letter.ptr;
+                deliver(m, topic_id(&m->pkt));
+                message_put(m);
+            } else if (letter.type == MAIL_INTEREST) {
+                auto *update = (interest_update *)letter.ptr;
+                if (update->local)
+                    set_local_interest(update->topic, letter.from, update->subscribed);
+                else
+                    set_interest(update->topic, letter.from, update->subscribed);
+                delete update;
+            } else if (letter.type == MAIL_HANDOFF) {
+                auto *h = (handoff *)letter.ptr;
+                attach_client(h->fd, h->id, h->version, h->resume, h->pending,
+                              h->cli_addr, h->clilen);
+                delete h;
+            }
+        }
+    }
+}
+
+void Worker::report(stats_request *request) {
+    worker_stats &stats = request->workers[index];
+    stats.index = index;
+    stats.metrics = metrics;
+
+    for (uint32_t id = 0; id < routes.size(); id++)
+        stats.topics.push_back({topics.name(id), routes[id].messages, routes[id].bytes});
+
+    for (auto client : clients.all) {
+        client_stats c{client->id, client->status == CLIENT_ONLINE, client->spilling != 0,
+                       client->out.size(), client->out.limit(), 0, 0, 0,
+                       client->replay_start != 0, client->replayed};
+        if (c.online) {
+            socklen_t len = sizeof(c.sndbuf_size);
+            ioctl(client->fd, SIOCOUTQ, &c.sndbuf_used);
+            getsockopt(client->fd, SOL_SOCKET, SO_SNDBUF, &c.sndbuf_size, &len);
+        }
+        for (const auto &cursor : client->backlog.cursors) {
+            uint64_t from = max(cursor.pos, cursor.log->first);
+            uint64_t to = Backlog::stop(cursor);
+            c.backlog += to > from ? to - from : 0;
+        }
+
+        stats.queued_bytes += c.queued;
+        stats.clients.push_back(std::move(c));
+    }
+
+    stats.pool_in_use = pool.in_use();
+    stats.pool_size = pool.size();
+    stats.message_bytes = stats.pool_in_use * sizeof(message);
+    stats.pool_slabs = pool.slab_count();
+    slab_stats slabs = slab_occupancy();
+    stats.slab_reserved = slabs.reserved;
+    stats.slab_in_use = slabs.in_use;
+    for (const auto &log : logs)
+        stats.log_entries += log.second.next - log.second.first;
+    stats.log_bytes = space.bytes;
+    stats.filters = filters.size();
+    stats.filter_checks = filters.checks();
+    stats.retained = retained.count();
+    stats.retained_bytes = retained.size();
+
+    // The last worker lets the broker know the snapshot is complete
+    uint64_t one = 1;
+    if (request->remaining.fetch_sub(1, memory_order_acq_rel) == 1)
+        DIE(write(request->done, &one, sizeof(one)) < 0, "write eventfd");
+}
+
+void Worker::announce_interest(const string &topic, int subscribed, int local) {
+    for (int w = 0; w < broker->nworkers; w++) {
+        if (w != index) {
+            post(w, MAIL_INTEREST, new interest_update{topic, subscribed, local});
+            continue;
+        }
+
+        // Our own copy gets updated right away
+        if (local)
+            set_local_interest(topic, index, subscribed);
+        else
+            set_interest(topic, index, subscribed);
+    }
+}
+
+void Worker::set_interest(const string &pattern, int worker, int subscribed) {
+    uint64_t bit = 1ull << worker;
+    auto entry = interest.find(pattern);
+    if (subscribed) {
+        if (entry == interest.end()) {
+            entry = interest.emplace(pattern, 0).first;
+            interest_patterns.insert(pattern);
+        }
+        entry->second |= bit;
+    } else if (entry != interest.end() && !(entry->second &= ~bit)) {
+        interest.erase(entry);
+        interest_patterns.remove(pattern);
+    }
+
+    // Any topic may route differently now
+    interest_gen++;
+}
+
+void Worker::set_local_interest(const string &pattern, int worker, int subscribed) {
+    // Only the workers with links need to know
+    if (links.empty())
+        return;
+
+    uint64_t bit = 1ull << worker;
+    uint64_t &mask = local_interest[pattern];
+    uint64_t before = mask;
+    mask = subscribed ? mask | bit : mask & ~bit;
+
+    // The first and the last worker with clients for the pattern
+    // change what we ask our peers for
+    if (!before != !mask) {
+        for (auto link : links) {
+            if (mask)
+                link->subscribe(pattern, 0);
+            else
+                link->unsubscribe(pattern);
+        }
+    }
+    if (!mask)
+        local_interest.erase(pattern);
+}
+
+void Worker::add_subscriber(Client *client, const string &pattern, int sf, uint32_t filter) {
+    vector<subscriber> &subscribers = topic_map[pattern];
+    subscribers.push_back({client, sf, filter});
+    if (subscribers.size() == 1)
+        patterns.insert(pattern);
+    if (filter != FILTER_NONE)
+        client->filters[pattern] = filter;
+    if (!client->peer)
+        local_subscribers[pattern]++;
+    subscribers_gen++;
+}
+
+void Worker::remove_subscriber(Client *client, const string &pattern) {
+    // Their order doesn't matter so the last one moves in
+    vector<subscriber> &subscribers = topic_map[pattern];
+    auto entry = find_if(subscribers.begin(), subscribers.end(),
+                         [client](const subscriber &s) { return s.client == client; });
+    if (entry->filter != FILTER_NONE) {
+        filters.release(entry->filter);
+        client->filters.erase(pattern);
+    }
+    *entry = subscribers.back();
+    subscribers.pop_back();
+
+    if (subscribers.empty()) {
+        topic_map.erase(pattern);
+        patterns.remove(pattern);
+    }
+    if (!client->peer && !--local_subscribers[pattern])
+        local_subscribers.erase(pattern);
+    subscribers_gen++;
+}
+
+void Worker::forget_topics(Client *client) {
+    for (const auto &topic : client->topics) {
+        remove_subscriber(client, topic.first);
+        if (!topic_map.count(topic.first))
+            announce_interest(topic.first, 0);
+    }
+    client->topics.clear();
+}
+
+// Leaves mail for another worker, it gets woken up by wake_pending()
+void Worker::post(int to, int type, void *ptr) {
+    mail letter{type, index, ptr};
+    Mailbox *box = broker->workers[to]->mailboxes[index];
+
+    pending_wake |= 1ull << to;
+    if (outbox[to].empty() && box->push(letter))
+        return;
+
+    // The other worker fell behind. Waiting for it here would mean going
+    // through our own mail in the middle of whatever posted this (a
+    // delivery, a disconnect), so the letter waits for the next round.
+    // Past a point, published messages go the way a full socket would
+    // send them
+    if (type == MAIL_PUBLISH && outbox[to].size() >= OUTBOX_LEN) {
+        message_put((message *)ptr);
+        metrics.mail_dropped++;
+        return;
+    }
+    outbox[to].push_back(letter);
+    outboxed++;
+}
+
+// Moves the mail waiting in the outbox into mailboxes that have room again
+void Worker::send_outbox() {
+    for (int w = 0; outboxed && w < broker->nworkers; w++) {
+        if (outbox[w].empty())
+            continue;
+
+        Mailbox *box = broker->workers[w]->mailboxes[index];
+        while (!outbox[w].empty() && box->push(outbox[w].front())) {
+            outbox[w].pop_front();
+            outboxed--;
+        }
+        pending_wake |= 1ull << w;
+    }
+}
+
+// Reads the datagrams that were left waiting for the outbox
+void Worker::resume_udp() {
+    for (auto bid : udp_held)
+        give_udp_buffer(bid);
+    udp_held.clear();
+    if (!udp_waiting)
+        return;
+
+    if (udp_ring) {
+        udp_waiting = false;
+        arm_udp();
+    } else {
+        handle_udp();
+    }
+}
+
+void Worker::wake_pending() {
+    uint64_t one = 1;
+    for (int w = 0; pending_wake; w++, pending_wake >>= 1) {
+        if (pending_wake & 1)
+            DIE(write(broker->workers[w]->wakefd, &one, sizeof(one)) < 0 &&
+                errno != EAGAIN, "write eventfd");
+    }
+}
+
+Broker::Broker(int portno, const broker_options &_options) {
+    options = _options;
+    nworkers = options.nworkers;
+    running.store(true);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    epoch = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    if (options.store_dir)
+        epoch = store_epoch(options.store_dir, epoch);
+    for (int i = 0; i < nworkers; i++)
+        workers.push_back(new Worker(this, i, portno));
+    for (auto worker : workers)
+        worker->restore();
+}
+
+Broker::~Broker() {
+    // Messages in the mailboxes may belong to any worker's pool
+    for (auto worker : workers)
+        worker->release_messages();
+    for (auto worker : workers)
+        delete worker;
+}
+
+void Broker::start() {
+    for (auto worker : workers)
+        threads.emplace_back(&Worker::run, worker);
+}
+
+void Broker::stop() {
+    running.store(false);
+
+    // Wake everyone up so they notice
+    uint64_t one = 1;
+    for (auto worker : workers)
+        DIE(write(worker->wakefd, &one, sizeof(one)) < 0, "write eventfd");
+
+    for (auto &thread : threads)
+        thread.join();
+    threads.clear();
+}
+
+vector<worker_stats> Broker::stats() {
+    stats_request request;
+    request.workers.resize(nworkers);
+    request.remaining.store(nworkers);
+    request.done = eventfd(0, EFD_CLOEXEC);
+    DIE(request.done < 0, "eventfd");
+
+    uint64_t one = 1;
+    for (auto worker : workers) {
+        worker->stats_wanted.store(&request, memory_order_release);
+        DIE(write(worker->wakefd, &one, sizeof(one)) < 0, "write eventfd");
+    }
+
+    uint64_t count;
+    DIE(read(request.done, &count, sizeof(count)) < 0, "read eventfd");
+    close(request.done);
+    return std::move(request.workers);
+}
@@ -0,0 +1,554 @@
+#ifndef _BROKER_H
+#define _BROKER_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include "client.h"
+#include "connection.h"
+#include "content_filter.h"
+#include "event_loop.h"
+#include "message.h"
+#include "metrics.h"
+#include "packet_pool.h"
+#include "retain_cache.h"
+#include "sf_log.h"
+#include "sf_store.h"
+#include "spsc_queue.h"
+#include "topic_table.h"
+#include "topic_trie.h"
+
+// The interest masks are 64 bits wide, one bit per worker
+#define MAX_WORKERS 64
+
+// Slots in every worker to worker ring
+#define MAILBOX_LEN 1024
+
+// Letters that may wait for room in one full mailbox, and how often
+// (ms) the worker holding them looks at the mailboxes again
+#define OUTBOX_LEN 4096
+#define OUTBOX_RETRY_MS 1
+
+// Datagrams read by a single recvmmsg call, and how many calls
+// handle_udp() makes before the rest of the loop gets a turn
+#define UDP_BATCH 64
+#define UDP_BATCHES 16
+
+// Messages every worker's pool grows by at a time
+#define POOL_SLAB 1024
+
+// Receive buffer we ask the kernel for, so bursts wait in the
+// socket instead of being dropped
+#define UDP_RCVBUF (8 * 1024 * 1024)
+
+// With io_uring, messages handed to the kernel to receive datagrams
+// into (a power of two) and the buffer group they make up
+#define UDP_RING 256
+#define UDP_GROUP 0
+
+// What an io_uring operation of a worker was, the rest of the tag
+// is the client for sends and writable polls
+#define TAG_ACCEPT (1ull << 56)
+#define TAG_UDP (2ull << 56)
+#define TAG_SEND (3ull << 56)
+#define TAG_WRITABLE (4ull << 56)
+#define TAG_KIND (0xffull << 56)
+
+// What happens when a subscriber's output queue is full
+#define OVERFLOW_DROP 0         // drop the oldest queued frames
+#define OVERFLOW_DISCONNECT 1   // kick the slow subscriber
+#define OVERFLOW_SPILL 2        // catch up from the topic logs later
+
+// Default output queue limit for every subscriber
+#define OUT_LIMIT (1024 * 1024)
+
+// How long (in ms) a new connection has to send its ID line
+#define HANDSHAKE_MS 5000
+
+// Longest command a client may send, a batch subscribe for a few
+// hundred topics has to fit
+#define COMMAND_LEN (64 * 1024)
+
+// Output queue limit of the links other brokers have to us, they
+// carry every subscriber of a node at once
+#define PEER_OUT_LIMIT (8 * 1024 * 1024)
+
+// Default bytes of retained frames every worker keeps
+#define RETAIN_LIMIT (16 * 1024 * 1024)
+
+// A client with this much queued is written at the end of the round
+// even if the flush delay would let it wait longer
+#define FLUSH_BYTES (64 * 1024)
+
+// Most bytes a client catching up on the logs gets moved into its queue
+// in one round, the rest waits for the next one
+#define REPLAY_SLICE (256 * 1024)
+
+// What store and forward does once a quota is full
+#define SF_DROP_OLDEST 0        // forget the oldest logged messages
+#define SF_DROP_NEWEST 1        // log nothing more until there's room
+#define SF_SPILL 2              // move the oldest ones to the spill directory
+
+// How often (in ms) clients that are behind are checked against
+// their quota, the worker wide quota is checked on every append
+#define SF_SWEEP_MS 100
+
+// Store and forward limits, 0 is no limit
+struct sf_quota {
+    uint64_t messages;
+    uint64_t bytes;
+};
+
+// Settings picked on the command line
+struct broker_options {
+    int nworkers;
+    size_t out_limit;
+    int overflow;
+
+    // Directory of the persistent store, nullptr keeps
+    // store and forward in memory only
+    const char *store_dir;
+    int fsync;
+
+    // LOOP_EPOLL or LOOP_URING
+    int io;
+
+    // Big writes of shared frames go out with MSG_ZEROCOPY
+    int zerocopy;
+
+    // How long (in us) published frames may wait for more to be
+    // written together, 0 writes them at the end of every round
+    long flush_delay;
+
+    // What store and forward may hold for every client and for the
+    // whole broker (every worker gets an equal share), what happens
+    // when it's full and where SF_SPILL puts the overflow
+    sf_quota client_quota, total_quota;
+    int sf_overflow;
+    const char *spill_dir;
+
+    // How long (in ns) logged messages are kept, 0 until everybody
+    // read them. Patterns in ttls get their own
+    uint64_t ttl;
+    std::unordered_map<std::string, uint64_t> ttls;
+
+    // Topics matching these patterns keep their last message for new
+    // subscribers, up to retain_limit bytes of them in every worker
+    std::vector<std::string> retain;
+    size_t retain_limit;
+
+    // Our name among the federated brokers and the brokers we link to.
+    // Every link subscribes to what our own clients want, so a node only
+    // gets the messages somebody here asked for
+    std::string node;
+    std::vector<struct sockaddr_in> peers;
+};
+
+// What a worker can ask another worker to do
+#define MAIL_PUBLISH 0
+#define MAIL_INTEREST 1
+#define MAIL_HANDOFF 2
+
+// A worker started or stopped having subscribers for a topic. Local
+// updates only count clients, not the links of other brokers
+struct interest_update {
+    std::string topic;
+    int subscribed;
+    int local;
+};
+
+// A client reconnected on a worker that doesn't own its state,
+// the connection moves over to the owner
+struct handoff {
+    int fd;
+    std::string id;
+    int version;
+    uint64_t resume;
+    std::string pending;
+    struct sockaddr_in cli_addr;
+    socklen_t clilen;
+};
+
+// A connection that was accepted but hasn't sent its whole ID line,
+// it's closed at deadline (CLOCK_MONOTONIC ns) if it still hasn't
+struct handshake {
+    std::string input;
+    struct sockaddr_in cli_addr;
+    socklen_t clilen;
+    uint64_t deadline;
+};
+
+// One entry of a worker to worker ring, ptr is a message for
+// MAIL_PUBLISH, an interest_update for MAIL_INTEREST and a handoff
+// for MAIL_HANDOFF
+struct mail {
+    int type;
+    int from;
+    void *ptr;
+};
+
+typedef SpscQueue<mail, MAILBOX_LEN> Mailbox;
+
+// One entry of a subscriber list, sf is the store and forward option
+// and filter the content filter's ID in the worker's FilterTable
+struct subscriber {
+    Client *client;
+    int sf;
+    uint32_t filter;
+};
+
+// Where a message published on a concrete topic goes: the workers that
+// have subscribers for it, and here the local subscribers of every
+// pattern that matches it along with their logs. Each half is only
+// valid while its generation matches the worker's.
+struct topic_route {
+    uint64_t workers;
+    uint64_t workers_gen;
+
+    std::vector<subscriber> subscribers;
+    std::vector<TopicLog *> logs;
+    uint64_t subscribers_gen;
+
+    // What was published on the topic through this worker
+    uint64_t messages;
+    uint64_t bytes;
+
+    // Matches a retain pattern, every worker gets what's
+    // published on it to keep the last one
+    bool retain;
+};
+
+// A snapshot of every worker, each one fills in its own entry on its
+// own thread and the last one to finish pokes done
+struct stats_request {
+    std::vector<worker_stats> workers;
+    std::atomic<int> remaining;
+    int done;
+};
+
+class Broker;
+
+// Each worker runs its own event loop on its own thread and owns
+// a share of the subscriber connections, along with their
+// subscriptions and store and forward queues. Nothing in here is
+// touched by another thread except the mailboxes and wakefd.
+class Worker {
+public:
+    int index;
+    Broker *broker;
+    EventLoop loop;
+
+    // SO_REUSEPORT sockets, the kernel spreads connections
+    // and datagrams between the workers
+    int sockfd, udpfd;
+
+    // eventfd the other workers poke after filling our mailboxes
+    int wakefd;
+
+    // Clients with something new queued. dirty are written at the end
+    // of the round, held once flushfd (a timerfd, only there with a
+    // flush delay) goes off
+    std::vector<Client *> dirty, held;
+    int flushfd;
+
+    // Clients that used up their slice of the logs this round and
+    // have more to catch up on, the loop doesn't block while there's any
+    std::vector<Client *> slices;
+
+    // timerfds for store and forward, only there when a TTL or a per
+    // client quota needs them. expirefd goes off when the first log on
+    // expiries has entries running out of time, sweepfd every SF_SWEEP_MS
+    int expirefd, sweepfd;
+    typedef std::pair<uint64_t, TopicLog *> expiry;
+    std::priority_queue<expiry, std::vector<expiry>, std::greater<expiry>> expiries;
+
+    // mailboxes[i] is only ever written by worker i
+    std::vector<Mailbox *> mailboxes;
+
+    // Workers we left mail for in this round and still need to wake up
+    uint64_t pending_wake;
+
+    // Mail that didn't fit in the other worker's mailbox yet, outbox[i]
+    // goes to worker i in order before anything new for it. outboxed
+    // counts the letters in all of them
+    std::vector<std::deque<mail>> outbox;
+    size_t outboxed;
+
+    // handle_udp() stopped before the socket ran dry, or the multishot
+    // receive ran out of buffers, nothing reports the datagrams still
+    // in the socket again
+    bool udp_waiting;
+
+    // Messages we receive datagrams into, recycled once every
+    // worker is done with them
+    PacketPool pool;
+
+    // recvmmsg reads straight into the packets of batch, slots that
+    // weren't filled by the last call are kept for the next one
+    message *batch[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+
+    // With io_uring: the loop's ring, nullptr with epoll. The kernel
+    // picks the message a datagram goes into from udp_ring, buffer i
+    // of the ring is udp_bufs[i]. Buffers in udp_held go back to the
+    // kernel once the outbox is empty, running out of them stops
+    // the multishot receive
+    Uring *ring;
+    struct io_uring_buf_ring *udp_ring;
+    message *udp_bufs[UDP_RING];
+    std::vector<uint16_t> udp_held;
+    struct msghdr udp_msg;
+
+    // Clients owned by this worker
+    ClientIndex clients;
+
+    // Kept open for when we run out of fds, closing it makes room to
+    // accept a waiting connection just to close it
+    int sparefd;
+
+    // Connections still waiting for their ID line, by fd. deadlines
+    // has their fds in the order they were accepted, so the one that
+    // runs out first is always at the front, and handshakefd (a
+    // timerfd) goes off for it
+    std::unordered_map<int, handshake> handshakes;
+    std::deque<std::pair<uint64_t, int>> deadlines;
+    int handshakefd;
+
+    // Topic Map keeps a list of Clients subscribed to a certain topic
+    // Makes finding and sending the messages to the appropiate clients fast.
+    // The keys are patterns that may hold wildcards, patterns has them all.
+    std::unordered_map<std::string, std::vector<subscriber>> topic_map;
+    TopicTrie patterns;
+
+    // Content filters of the subscriptions, shared by the ones
+    // with the same predicate
+    FilterTable filters;
+
+    // Concrete topics get an ID the first time they're published, from
+    // then on their route is found by indexing routes with it.
+    // Changing a subscription or an interest bumps the generation,
+    // which makes every cached route stale at once.
+    TopicTable topics;
+    std::vector<topic_route> routes;
+    uint64_t subscribers_gen, interest_gen;
+
+    // Store and Forward logs, one per subscribed pattern. Clients that
+    // are away (or spilling) only keep a cursor into them, so every
+    // message is kept once no matter how many clients still need it.
+    // space is what they hold together, and our share of the quota
+    LogSpace space;
+    sf_quota quota;
+    std::unordered_map<std::string, TopicLog> logs;
+
+    // Order of the last message appended to any log
+    uint64_t published;
+
+    // Segment files and client journal, nullptr without --store.
+    // spillover takes the logs' overflow with SF_SPILL
+    Store *store;
+    Store *spillover;
+
+    // The last message of every retained topic, so new subscribers
+    // don't wait for the next publish
+    TopicTrie retain_patterns;
+    RetainCache retained;
+
+    // Our own copy of which workers have subscribers for a pattern,
+    // kept up to date through MAIL_INTEREST so ingest needs no locks
+    std::unordered_map<std::string, uint64_t> interest;
+    TopicTrie interest_patterns;
+
+    // The same without the other brokers' links, what we advertise
+    // to them. local_subscribers counts our clients of every pattern
+    std::unordered_map<std::string, uint64_t> local_interest;
+    std::unordered_map<std::string, int> local_subscribers;
+
+    // Links to the peers this worker looks after, every peer is
+    // taken care of by a single worker
+    std::vector<Connection *> links;
+
+    // Our counters and histograms, nobody else reads them directly
+    worker_metrics metrics;
+
+    // Set by Broker::stats() before it wakes us up
+    std::atomic<stats_request *> stats_wanted;
+
+    Worker(Broker *broker, int index, int portno);
+    ~Worker();
+
+    // Brings back the clients and cursors the store remembers,
+    // called for every worker before any of them starts
+    void restore();
+
+    // Event loop of the worker thread, returns once the broker stops
+    void run();
+
+    // Drops every message we hold a reference to (mailboxes and logs),
+    // every worker does this before any pool goes away
+    void release_messages();
+
+private:
+    void handle_accept();
+    bool refuse_connection();
+    void accept_client(int fd, struct sockaddr_in cli_addr, socklen_t clilen);
+    void handle_handshake(int fd);
+    void expire_handshakes();
+    void drop_handshake(int fd);
+    void handle_udp();
+
+    // Forwards a datagram of n bytes read into m, or drops it
+    void ingest(message *m, size_t n);
+    void route(message *m);
+
+    // A message another broker forwarded over one of our links
+    void ingest_peer(const packet *p);
+
+    // io_uring only: multishot accepts and receives, sends that
+    // finish later and what all of them finished with
+    void arm_accept();
+    void arm_udp();
+    void give_udp_buffer(uint16_t bid);
+    void udp_received(const completion &c);
+    void send_async(Client *client);
+    void sent(Client *client, int res);
+    void handle_completions();
+    void handle_client(int fd, uint32_t events);
+    void handle_command(Client *client, char *line);
+
+    // Runs every complete command in the client's input
+    void handle_input(Client *client);
+
+    // The work behind a single subscribe or unsubscribe, the client
+    // mustn't have the topic already, or has to have it to unsubscribe
+    void subscribe(Client *client, const std::string &topic, int option, uint32_t filter);
+    void unsubscribe(Client *client, const std::string &topic);
+    void handle_mail();
+
+    // Fills in our part of a stats snapshot
+    void report(stats_request *request);
+
+    // Finishes the handshake for a client this worker owns, resume is
+    // the last sequence number a version 3 client got, 0 for none,
+    // and pending whatever followed the ID line
+    void attach_client(int fd, const std::string &id, int version, uint64_t resume,
+                       const std::string &pending, struct sockaddr_in cli_addr,
+                       socklen_t clilen);
+
+    // ID of the packet's topic in our table
+    uint32_t topic_id(const packet *p);
+
+    // Which workers and which local clients a concrete topic goes to
+    uint64_t workers_for(uint32_t topic);
+    const topic_route &resolve(uint32_t topic);
+
+    // Forwards a message to the local subscribers of its topic
+    void deliver(message *m, uint32_t topic);
+
+    // Queues a frame for a connected client and tries to write it,
+    // false means it didn't fit and the client has to spill
+    bool send_to(Client *client, const char *data, size_t len, message *m = nullptr);
+    void reply(Client *client, const char *text);
+
+    // Queues the cached last message of every topic pattern matches
+    // that gets through the subscription's filter
+    void send_retained(Client *client, const std::string &pattern, uint32_t filter);
+
+    // Writes out as much of the client's queue as the socket takes
+    void flush(Client *client);
+
+    // Puts the client on the list that gets written next, urgent ones
+    // don't wait for the flush delay
+    void schedule(Client *client, bool urgent);
+    void flush_dirty();
+    void flush_held();
+    void flush_slices();
+
+    TopicLog *log_of(const std::string &topic);
+
+    // Appends to a log, then makes room if that went over the quota.
+    // False if SF_DROP_NEWEST had no room for it
+    bool log_append(TopicLog *log, message *m, uint64_t order);
+
+    // Puts the log on the expiry heap if it isn't, and drops
+    // what ran out of time from the logs whose turn it is
+    void arm_expiry(TopicLog *log);
+    void expire_logs();
+
+    // Brings a client that is behind back under its quota
+    void enforce_quota(Client *client);
+    void sweep_quotas();
+
+    // Starts reading every topic of the client from the logs, from
+    // m (published with order) where it matches and from the next
+    // entry everywhere else
+    void spill(Client *client, message *m, uint64_t order);
+
+    void unspill(Client *client);
+
+    void disconnect(Client *client);
+
+    // Tells every worker (us included) whether we have subscribers for
+    // topic, or only clients that aren't other brokers if local is set
+    void announce_interest(const std::string &topic, int subscribed, int local = 0);
+    void set_interest(const std::string &pattern, int worker, int subscribed);
+    void set_local_interest(const std::string &pattern, int worker, int subscribed);
+
+    void add_subscriber(Client *client, const std::string &pattern, int sf,
+                        uint32_t filter = FILTER_NONE);
+
+    // Whether the entry at pos of log gets past the client's filters,
+    // the way it would have when it was published
+    bool log_passes(Client *client, TopicLog *log, uint64_t pos);
+    void remove_subscriber(Client *client, const std::string &pattern);
+
+    // A peer that went away subscribes again once it's back
+    void forget_topics(Client *client);
+
+    void post(int to, int type, void *ptr);
+    void send_outbox();
+    void resume_udp();
+    void wake_pending();
+};
+
+// State shared by every worker
+class Broker {
+public:
+    broker_options options;
+    int nworkers;
+    std::vector<Worker *> workers;
+    std::atomic<bool> running;
+
+    // Which worker owns the state of each client ID, only used
+    // while a client connects so the lock stays off the fanout path
+    std::mutex owners_lock;
+    std::unordered_map<std::string, int> owners;
+
+    // Tells this run apart from every other one. Sequence numbers start
+    // over with a restart, so version 3 clients learn it in the HELLO
+    // and a resume only counts when they bring the same one back. With
+    // --store they carry on instead, and so does the epoch
+    uint64_t epoch;
+
+    Broker(int portno, const broker_options &options);
+    ~Broker();
+
+    // Starts a thread per worker, stop() makes them return
+    void start();
+    void stop();
+
+    // Asks every running worker for a snapshot and waits for them
+    std::vector<worker_stats> stats();
+
+private:
+    std::vector<std::thread> threads;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef _CLIENT_H
+#define _CLIENT_H 1
+
+#include <algorithm>
+#include <deque>
+#include <netinet/in.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "helpers.h"
+#include "out_queue.h"
+#include "sf_log.h"
+
+// Whether a client is connected right now, away clients only
+// keep their subscriptions and store and forward cursors
+#define CLIENT_ONLINE 0
+#define CLIENT_AWAY 1
+
+// Clients whose ID starts with this are other brokers
+#define PEER_PREFIX '@'
+
+// Whether a client's queue is waiting to be written
+#define FLUSH_NONE 0
+#define FLUSH_ROUND 1           // at the end of this event loop round
+#define FLUSH_HELD 2            // once the flush delay is up
+#define FLUSH_SLICE 3           // next round, it has more backlog to catch up on
+
+// Client class to hold info
+// cli_addr and clilen aren't required but could be useful if this
+// was a real app that could require more stuff later
+class Client {
+public:
+    // File descriptor for the client, CLIENT_DISCONNECTED while away
+    int fd;
+
+    // CLIENT_ONLINE or CLIENT_AWAY
+    int status;
+
+    // ID of client
+    std::string id;
+
+    // Client IP and length
+    struct sockaddr_in cli_addr{};
+    socklen_t clilen;
+
+    // Wire format agreed on during the handshake
+    int version;
+
+    // Another broker's link, it never gets what came from a peer
+    int peer;
+
+    // A Map to keep track which Topics
+    // are subscribed with SF and which aren't
+    std::unordered_map<std::string, int> topics;
+
+    // The content filter of every one of them that has one
+    std::unordered_map<std::string, uint32_t> filters;
+
+    // Bytes of a command that didn't end in the last read
+    std::string input;
+
+    // Set when a command got too long, the rest of it is
+    // thrown away up to its '\n'
+    bool discarding;
+
+    // Frames waiting for the socket to become writable
+    OutQueue out;
+
+    // Set once out overflowed with the spill policy, from then on
+    // the client reads from the topic logs until it caught up
+    int spilling;
+
+    // Cursors into the topic logs, for every store and forward topic
+    // while the client is away and for every topic while it's spilling
+    Backlog backlog;
+
+    // Version 3 clients only: cursors at the first entry of every store
+    // and forward topic they haven't acknowledged yet while online
+    Backlog unacked;
+
+    // Replies that didn't fit in out while spilling
+    std::deque<std::string> replies;
+
+    // With io_uring a write of out is going on, msg has to stay put
+    // until it finishes. A write that was still going when the client
+    // disconnected is stale, whatever it returns is ignored
+    int sending;
+    int send_stale;
+    struct msghdr send_msg;
+    struct iovec send_iov[OUT_IOV];
+
+    // Writes of out may use MSG_ZEROCOPY on this connection
+    int zerocopy;
+
+    // Which list of the worker's the client waits on to be written,
+    // FLUSH_NONE, FLUSH_ROUND, FLUSH_HELD or FLUSH_SLICE
+    int pending;
+
+    // now_ns() when the client reconnected with a store and forward
+    // backlog, 0 once it caught up, and how many messages replay sent
+    // it so far
+    uint64_t replay_start;
+    uint64_t replayed;
+
+    // Simple Constructor
+    Client(int _fd, std::string _id, struct sockaddr_in _cli_addr, socklen_t _clilen,
+           int _version, size_t out_limit) : out(out_limit) {
+        fd = _fd;
+        status = fd == CLIENT_DISCONNECTED ? CLIENT_AWAY : CLIENT_ONLINE;
+        spilling = 0;
+        discarding = false;
+        sending = send_stale = 0;
+        zerocopy = 0;
+        pending = FLUSH_NONE;
+        replay_start = replayed = 0;
+        id = std::string(std::move(_id));
+        cli_addr = _cli_addr;
+        clilen = _clilen;
+        version = _version;
+        peer = id[0] == PEER_PREFIX;
+    }
+};
+
+// Every client a worker knows about, found by ID through a hash map
+// and by socket through a dense array indexed by the fd
+class ClientIndex {
+public:
+    // every client, online or away
+    std::vector<Client *> all;
+
+    // nullptr if nobody has the ID or nobody online has the fd
+    Client *by_id(const std::string &id) const {
+        auto entry = ids.find(id);
+        return entry == ids.end() ? nullptr : entry->second;
+    }
+
+    Client *by_fd(int fd) const {
+        return fd >= 0 && (size_t)fd < fds.size() ? fds[fd] : nullptr;
+    }
+
+    // Takes a new client, online or not
+    void add(Client *client) {
+        all.push_back(client);
+        ids[client->id] = client;
+        if (client->status == CLIENT_ONLINE)
+            online(client, client->fd);
+    }
+
+    // The client is back on fd
+    void online(Client *client, int fd) {
+        if ((size_t)fd >= fds.size())
+            fds.resize(std::max((size_t)fd + 1, fds.size() * 2), nullptr);
+        fds[fd] = client;
+        client->fd = fd;
+        client->status = CLIENT_ONLINE;
+    }
+
+    // The client's socket is gone, the fd may be reused right away
+    void away(Client *client) {
+        if (client->status == CLIENT_ONLINE)
+            fds[client->fd] = nullptr;
+        client->fd = CLIENT_DISCONNECTED;
+        client->status = CLIENT_AWAY;
+    }
+
+private:
+    std::unordered_map<std::string, Client *> ids;
+    std::vector<Client *> fds;
+};
+
+#endif
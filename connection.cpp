@@ -0,0 +1,331 @@
+#include "connection.h"
+#include <fcntl.h>
+#include <sys/timerfd.h>
+
+using namespace std;
+
+// Bytes read from the socket in one go
+#define READ_CHUNK (64 * 1024)
+
+Connection::Connection(EventLoop *_loop, string _id, struct sockaddr_in _server,
+                       connection_handlers _handlers, bool _reconnect) {
+    loop = _loop;
+    id = std::move(_id);
+    server = _server;
+    handlers = std::move(_handlers);
+    reconnect = _reconnect;
+
+    current = CONN_IDLE;
+    sockfd = -1;
+    backoff = BACKOFF_MIN_MS;
+    version = FRAME_V2;
+    seen = acked = epoch = 0;
+
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    DIE(timerfd < 0, "timerfd_create");
+    DIE(loop->add(timerfd, EPOLLIN) < 0, "epoll_ctl");
+}
+
+Connection::~Connection() {
+    drop_socket();
+    loop->remove(timerfd);
+    ::close(timerfd);
+}
+
+void Connection::start() {
+    if (current == CONN_IDLE)
+        connect_now();
+}
+
+void Connection::connect_now() {
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DIE(sockfd < 0, "socket");
+    set_socket_options(sockfd);
+
+    // EPOLLOUT tells us when the connect finished, after that it only
+    // fires again once a full socket has room
+    DIE(loop->add(sockfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0, "epoll_ctl");
+    set_state(CONN_CONNECTING, 0);
+
+    int ret = connect(sockfd, (struct sockaddr *)&server, sizeof(server));
+    if (ret == 0)
+        on_connected();
+    else if (errno != EINPROGRESS)
+        lost();
+}
+
+// As per protocol, we send ID immediately after connecting followed
+// by the frame version we understand and, once we've seen one, the last
+// sequence number and its epoch so the broker knows where to resume.
+// Commands wait for the HELLO
+void Connection::on_connected() {
+    set_state(CONN_HANDSHAKE, 0);
+    out = id + " " + to_string(FRAME_VERSION);
+    if (seen)
+        out += " " + to_string(seen) + " " + to_string(epoch);
+    out += "\n";
+    acked = seen;
+    write_out();
+}
+
+void Connection::subscribe(const string &pattern, int sf, const string &filter) {
+    subscriptions[pattern] = subscription{sf, filter};
+    if (current == CONN_READY)
+        send_command(subscribe_line(pattern, subscriptions[pattern]));
+}
+
+void Connection::unsubscribe(const string &pattern) {
+    subscriptions.erase(pattern);
+    if (current == CONN_READY)
+        send_command("unsubscribe " + pattern + "\n");
+}
+
+string Connection::subscribe_line(const string &pattern, const subscription &s) {
+    string line = "subscribe " + pattern + " " + to_string(s.sf);
+    if (!s.filter.empty())
+        line += " " + s.filter;
+    return line + "\n";
+}
+
+void Connection::send_command(const string &line) {
+    out += line;
+    write_out();
+}
+
+void Connection::close() {
+    drop_socket();
+
+    struct itimerspec off{};
+    timerfd_settime(timerfd, 0, &off, nullptr);
+    set_state(CONN_CLOSED, CLOSE_LOCAL);
+}
+
+bool Connection::handle(int fd, uint32_t events) {
+    if (fd == timerfd) {
+        uint64_t expirations;
+        DIE(read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN,
+            "read timerfd");
+        if (current == CONN_WAITING)
+            connect_now();
+        return true;
+    }
+    if (fd != sockfd || sockfd < 0)
+        return false;
+
+    if (current == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            lost();
+            return true;
+        }
+        if (!(events & EPOLLOUT))
+            return true;
+        on_connected();
+    } else if (events & EPOLLOUT) {
+        write_out();
+    }
+
+    if (fd == sockfd && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        read_frames();
+    return true;
+}
+
+void Connection::write_out() {
+    while (!out.empty()) {
+        ssize_t n = send(sockfd, out.data(), out.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                lost();
+            return;
+        }
+        out.erase(0, n);
+    }
+}
+
+void Connection::read_frames() {
+    int fd = sockfd;
+    bool closed = false;
+
+    // Edge triggered, so read until the socket runs dry
+    while (true) {
+        size_t used = in.size();
+        in.resize(used + READ_CHUNK);
+        ssize_t n = recv(fd, in.data() + used, READ_CHUNK, 0);
+        in.resize(used + max(n, (ssize_t)0));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            closed = true;
+            break;
+        }
+    }
+
+    // Handle every complete frame, a callback may close us on the way
+    size_t pos = 0;
+    while (sockfd == fd && in.size() - pos >= sizeof(uint16_t)) {
+        uint16_t len;
+        memcpy(&len, in.data() + pos, sizeof(len));
+        size_t frame_len = sizeof(len) + ntohs(len);
+        if (frame_len < sizeof(frame_header) || frame_len > MAX_FRAME_LEN) {
+            drop_socket();
+            set_state(CONN_CLOSED, CLOSE_PROTOCOL);
+            return;
+        }
+        if (in.size() - pos < frame_len)
+            break;
+
+        handle_frame(in.data() + pos, frame_len);
+        pos += frame_len;
+    }
+    if (sockfd != fd)
+        return;
+
+    in.erase(in.begin(), in.begin() + pos);
+    if (closed)
+        lost();
+    else
+        acknowledge();
+}
+
+// One cumulative ack for everything the last read brought
+void Connection::acknowledge() {
+    if (current == CONN_READY && seen > acked) {
+        acked = seen;
+        send_command("ack " + to_string(seen) + "\n");
+    }
+}
+
+void Connection::handle_frame(const char *frame, size_t len) {
+    // decode_frame '\0' terminates whatever it can, nothing else
+    // needs to be cleared
+    packet p;
+    uint64_t seq;
+    int payload_len = decode_frame(frame, len, &p, &seq);
+    if (payload_len < 0)
+        return;
+
+    if (current == CONN_HANDSHAKE) {
+        // The server tells us which version it settled on, older
+        // servers don't know about compact frames at all
+        if (p.data_t != PACKET_HELLO || p.payload[0] < FRAME_V2 ||
+            p.payload[0] > FRAME_VERSION) {
+            drop_socket();
+            set_state(CONN_CLOSED, CLOSE_PROTOCOL);
+            return;
+        }
+
+        backoff = BACKOFF_MIN_MS;
+        version = p.payload[0];
+
+        // A broker that restarted counts from scratch, and whatever we
+        // had seen from the old run says nothing about the new one
+        uint64_t run = 0;
+        if (version >= FRAME_V3 && payload_len >= 1 + (int)sizeof(run)) {
+            memcpy(&run, p.payload + 1, sizeof(run));
+            run = be64toh(run);
+        }
+        if (run != epoch) {
+            seen = acked = 0;
+            epoch = run;
+        }
+        set_state(CONN_READY, 0);
+
+        // The server keeps our subscriptions while we're away and
+        // ignores the ones it already has, but it may have restarted.
+        // The ones without a filter go in batches, one reply each
+        string batch;
+        for (const auto &subscription : subscriptions) {
+            const auto &s = subscription.second;
+            if (!s.filter.empty()) {
+                out += subscribe_line(subscription.first, s);
+                continue;
+            }
+            string entry = " " + subscription.first + " " + to_string(s.sf);
+            if (!batch.empty() && batch.size() + entry.size() >= BATCH_LEN) {
+                out += "msubscribe" + batch + "\n";
+                batch.clear();
+            }
+            batch += entry;
+        }
+        if (!batch.empty())
+            out += "msubscribe" + batch + "\n";
+        write_out();
+        return;
+    }
+
+    if (p.data_t == PACKET_REPLY) {
+        // ERRSAMEID means someone else is connected with our ID
+        if (!strcmp(p.payload, "ERRSAMEID")) {
+            drop_socket();
+            set_state(CONN_CLOSED, CLOSE_SAME_ID);
+            return;
+        }
+        if (handlers.on_reply)
+            handlers.on_reply(string_view(p.payload, strnlen(p.payload, PAYLOAD_LEN)));
+        return;
+    }
+
+    // A replayed message we already had can't come back after a resume,
+    // but the broker may still send it if it lost track of us
+    if (seq) {
+        if (seq <= seen)
+            return;
+        seen = seq;
+    }
+
+    if (handlers.on_packet)
+        handlers.on_packet(&p);
+
+    if (p.data_t == PACKET_INT && handlers.on_int) {
+        auto *p_int = (const packet_int *)p.payload;
+        int64_t val = ntohl(p_int->val);
+        handlers.on_int(&p, p_int->sign == 1 ? -val : val);
+    } else if (p.data_t == PACKET_SHORT_REAL && handlers.on_short_real) {
+        auto *p_short_real = (const packet_short_real *)p.payload;
+        handlers.on_short_real(&p, ntohs(p_short_real->val) / 100.0);
+    } else if (p.data_t == PACKET_FLOAT && handlers.on_float) {
+        auto *p_float = (const packet_float *)p.payload;
+        double val = ntohl(p_float->val);
+        for (int i = 0; i < p_float->power; i++)
+            val /= 10;
+        handlers.on_float(&p, p_float->sign == 1 ? -val : val);
+    } else if (p.data_t == PACKET_STRING && handlers.on_string) {
+        handlers.on_string(&p, string_view(p.payload, strnlen(p.payload, PAYLOAD_LEN)));
+    }
+}
+
+void Connection::lost() {
+    drop_socket();
+    in.clear();
+    out.clear();
+
+    if (!reconnect) {
+        set_state(CONN_CLOSED, CLOSE_SERVER);
+        return;
+    }
+
+    // Try again later, backing off further every time it fails
+    struct itimerspec when{};
+    when.it_value.tv_sec = backoff / 1000;
+    when.it_value.tv_nsec = (long)(backoff % 1000) * 1000000;
+    DIE(timerfd_settime(timerfd, 0, &when, nullptr) < 0, "timerfd_settime");
+    backoff = min(backoff * 2, BACKOFF_MAX_MS);
+    set_state(CONN_WAITING, 0);
+}
+
+// Closing the fd drops it from epoll, io_uring has to be told
+void Connection::drop_socket() {
+    if (sockfd < 0)
+        return;
+    loop->remove(sockfd);
+    ::close(sockfd);
+    sockfd = -1;
+}
+
+void Connection::set_state(int state, int reason) {
+    current = state;
+    if (handlers.on_state)
+        handlers.on_state(state, reason);
+}
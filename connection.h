@@ -0,0 +1,140 @@
+#ifndef _CONNECTION_H
+#define _CONNECTION_H 1
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "event_loop.h"
+#include "helpers.h"
+
+// Where a connection is at
+#define CONN_IDLE 0         // start() wasn't called yet
+#define CONN_CONNECTING 1   // waiting for the TCP connect
+#define CONN_HANDSHAKE 2    // ID sent, waiting for HELLO
+#define CONN_READY 3        // messages and commands flow
+#define CONN_WAITING 4      // lost the server, reconnecting after a backoff
+#define CONN_CLOSED 5       // for good, see the reason
+
+// Why a connection closed
+#define CLOSE_LOCAL 0       // close() was called
+#define CLOSE_SERVER 1      // the server went away and reconnect is off
+#define CLOSE_SAME_ID 2     // another client with our ID is connected
+#define CLOSE_PROTOCOL 3    // the server doesn't speak compact frames
+
+// Reconnect backoff, doubled after every failed attempt
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 10000
+
+// Subscriptions sent again after a reconnect go out as batch
+// subscribes of at most this many bytes each
+#define BATCH_LEN (16 * 1024)
+
+// What the broker sends, every callback can be left empty.
+// The packet is only valid during the call.
+struct connection_handlers {
+    // Every message from a publisher, before its typed callback
+    std::function<void(const packet *)> on_packet;
+
+    std::function<void(const packet *, int64_t)> on_int;
+    std::function<void(const packet *, double)> on_short_real;
+    std::function<void(const packet *, double)> on_float;
+    std::function<void(const packet *, std::string_view)> on_string;
+
+    // Replies to commands, "Subscribed to topic.\n" and the like
+    std::function<void(std::string_view)> on_reply;
+
+    // The state changed, reason only means something for CONN_CLOSED
+    std::function<void(int state, int reason)> on_state;
+};
+
+// One subscriber session with the broker, driven by the caller's
+// event loop. Nothing ever blocks: commands are queued and written
+// back to back as the socket takes them, replies and messages are
+// parsed out of whatever has been read so far.
+// With reconnect on, a lost connection is retried with a growing
+// backoff under the same ID, so the broker replays what the store
+// and forward topics missed, and every subscription is sent again in
+// case the broker forgot it, as few batch subscribes as they fit in.
+// Messages on store and forward topics come with a sequence number,
+// after every read the highest one seen is acknowledged so the broker
+// can let go of them, and a reconnect resumes right after it: nothing
+// that was lost with the old connection is missing and nothing that
+// made it is sent twice.
+class Connection {
+public:
+    Connection(EventLoop *loop, std::string id, struct sockaddr_in server,
+               connection_handlers handlers, bool reconnect);
+    Connection(const Connection &) = delete;
+    ~Connection();
+
+    // Starts connecting
+    void start();
+
+    // Queued until the connection is ready, pattern may hold wildcards
+    // and filter is an optional content filter ("> 20", "10..30", "~0.5")
+    void subscribe(const std::string &pattern, int sf, const std::string &filter = "");
+    void unsubscribe(const std::string &pattern);
+
+    // Closes the connection for good
+    void close();
+
+    // Handles events on fd if it's one of ours, false otherwise
+    bool handle(int fd, uint32_t events);
+
+    int state() const { return current; }
+
+    // Highest sequence number seen, 0 before the first one
+    uint64_t last_seq() const { return seen; }
+
+    // The socket events come in on, -1 while there's none. Lets a loop
+    // with many connections find the right one without asking them all
+    int fd() const { return sockfd; }
+
+private:
+    EventLoop *loop;
+    std::string id;
+    struct sockaddr_in server;
+    connection_handlers handlers;
+    bool reconnect;
+
+    int current;
+    int sockfd;
+
+    // timerfd that fires when it's time to reconnect
+    int timerfd;
+    int backoff;
+
+    // Version the broker settled on, and the highest sequence number
+    // we've seen and the last one we acknowledged. They only mean
+    // something for the broker run the epoch from the HELLO names
+    int version;
+    uint64_t seen, acked, epoch;
+
+    // What we asked for, sent again after every reconnect
+    struct subscription {
+        int sf;
+        std::string filter;
+    };
+    std::unordered_map<std::string, subscription> subscriptions;
+
+    // Bytes read but not handled yet and bytes not written yet
+    std::vector<char> in;
+    std::string out;
+
+    void connect_now();
+    void on_connected();
+    void send_command(const std::string &line);
+    static std::string subscribe_line(const std::string &pattern, const subscription &s);
+    void read_frames();
+    void acknowledge();
+    void handle_frame(const char *frame, size_t len);
+    void write_out();
+    void lost();
+    void drop_socket();
+    void set_state(int state, int reason);
+};
+
+#endif
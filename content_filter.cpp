@@ -0,0 +1,141 @@
+#include "content_filter.h"
+#include "message.h"
+#include <cctype>
+#include <cmath>
+
+using namespace std;
+
+// Every character of text went into the number
+static bool parse_number(const string &text, double *value) {
+    if (text.empty())
+        return false;
+    char *end;
+    *value = strtod(text.c_str(), &end);
+    return *end == 0 && isfinite(*value);
+}
+
+bool parse_filter(const char *text, content_filter *filter) {
+    string s;
+    for (const char *c = text; *c; c++) {
+        if (!isspace((unsigned char)*c))
+            s += *c;
+    }
+
+    // Two character operators go first so ">=" isn't read as ">"
+    static const struct {
+        const char *prefix;
+        int op;
+    } ops[] = {{">=", FILTER_GE}, {"<=", FILTER_LE}, {"!=", FILTER_NE},
+               {">", FILTER_GT},  {"<", FILTER_LT},  {"=", FILTER_EQ},
+               {"~", FILTER_CHANGE}};
+    filter->b = 0;
+    for (const auto &op : ops) {
+        size_t len = strlen(op.prefix);
+        if (s.compare(0, len, op.prefix))
+            continue;
+        filter->op = op.op;
+        return parse_number(s.substr(len), &filter->a) &&
+               (op.op != FILTER_CHANGE || filter->a >= 0);
+    }
+
+    // strtod would take the first '.' of ".." as part of the number
+    size_t dots = s.find("..");
+    filter->op = FILTER_RANGE;
+    return dots != string::npos && parse_number(s.substr(0, dots), &filter->a) &&
+           parse_number(s.substr(dots + 2), &filter->b) && filter->a <= filter->b;
+}
+
+string filter_text(const content_filter &filter) {
+    static const char *prefixes[] = {">", ">=", "<", "<=", "=", "!=", "", "~"};
+    char text[64];
+    if (filter.op == FILTER_RANGE)
+        snprintf(text, sizeof(text), "%.17g..%.17g", filter.a, filter.b);
+    else
+        snprintf(text, sizeof(text), "%s%.17g", prefixes[filter.op], filter.a);
+    return text;
+}
+
+uint32_t FilterTable::acquire(const content_filter &filter) {
+    // Subscribing is rare next to publishing, a scan is fine
+    uint32_t free = FILTER_NONE;
+    for (uint32_t id = 0; id < entries.size(); id++) {
+        const entry &e = entries[id];
+        if (!e.refs) {
+            free = min(free, id);
+            continue;
+        }
+        if (e.filter.op == filter.op && e.filter.a == filter.a && e.filter.b == filter.b) {
+            entries[id].refs++;
+            return id;
+        }
+    }
+
+    if (free == FILTER_NONE) {
+        free = entries.size();
+        entries.emplace_back();
+    }
+    entries[free] = entry{filter, 1, 0, false};
+    used++;
+    return free;
+}
+
+void FilterTable::release(uint32_t id) {
+    if (--entries[id].refs)
+        return;
+    used--;
+
+    // Whoever gets the ID next starts from scratch
+    if (entries[id].filter.op == FILTER_CHANGE) {
+        for (auto it = last.begin(); it != last.end();) {
+            if (it->first >> 32 == id)
+                it = last.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+bool FilterTable::passes(uint32_t id, const message *m, uint32_t topic, uint64_t stamp) {
+    entry &e = entries[id];
+    if (e.stamp == stamp)
+        return e.verdict;
+    e.stamp = stamp;
+    tested++;
+
+    if (e.filter.op != FILTER_CHANGE || !m->numeric) {
+        e.verdict = test(id, m->numeric, m->value);
+        return e.verdict;
+    }
+
+    // The first value on a topic always goes through
+    auto seen = last.emplace(((uint64_t)id << 32) | topic, m->value);
+    e.verdict = seen.second || fabs(m->value - seen.first->second) > e.filter.a;
+    if (e.verdict)
+        seen.first->second = m->value;
+    return e.verdict;
+}
+
+bool FilterTable::test(uint32_t id, bool numeric, double value) const {
+    const content_filter &f = entries[id].filter;
+    if (!numeric)
+        return false;
+
+    switch (f.op) {
+        case FILTER_GT:
+            return value > f.a;
+        case FILTER_GE:
+            return value >= f.a;
+        case FILTER_LT:
+            return value < f.a;
+        case FILTER_LE:
+            return value <= f.a;
+        case FILTER_EQ:
+            return value == f.a;
+        case FILTER_NE:
+            return value != f.a;
+        case FILTER_RANGE:
+            return value >= f.a && value <= f.b;
+        default:
+            return true;
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef _CONTENT_FILTER_H
+#define _CONTENT_FILTER_H 1
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct message;
+
+// ID of a subscription without a filter
+#define FILTER_NONE UINT32_MAX
+
+// What a filter compares the value with
+#define FILTER_GT 0         // >a
+#define FILTER_GE 1         // >=a
+#define FILTER_LT 2         // <a
+#define FILTER_LE 3         // <=a
+#define FILTER_EQ 4         // =a
+#define FILTER_NE 5         // !=a
+#define FILTER_RANGE 6      // a..b, both included
+#define FILTER_CHANGE 7     // ~a, moved by more than a since the last one let through
+
+// A predicate over the number an INT, SHORT_REAL or FLOAT message
+// holds, strings never pass one
+struct content_filter {
+    int op;
+    double a, b;
+};
+
+// Parses what follows the store and forward option of a subscribe,
+// spaces are ignored. False if it isn't a filter
+bool parse_filter(const char *text, content_filter *filter);
+
+// The same filter as parse_filter() takes it, without spaces
+std::string filter_text(const content_filter &filter);
+
+// Every distinct filter the subscriptions of a worker use. Subscribers
+// with the same predicate share an ID, so a message is only tested
+// once against it however many of them there are. FILTER_CHANGE keeps
+// the last value it let through for every concrete topic.
+class FilterTable {
+public:
+    FilterTable() : used(0), tested(0) {}
+
+    // The ID of filter, counting one more subscription using it
+    uint32_t acquire(const content_filter &filter);
+    void release(uint32_t id);
+
+    const content_filter &get(uint32_t id) const { return entries[id].filter; }
+
+    // Whether m, published on topic, passes filter id. The first call
+    // for a message decides, stamp has to be different for every one
+    bool passes(uint32_t id, const message *m, uint32_t topic, uint64_t stamp);
+
+    // Tests a value with no message around it (retained frames),
+    // FILTER_CHANGE always passes since there's nothing to compare with
+    bool test(uint32_t id, bool numeric, double value) const;
+
+    // Filters in use and how often one was actually tested
+    size_t size() const { return used; }
+    uint64_t checks() const { return tested; }
+
+private:
+    struct entry {
+        content_filter filter;
+        int refs;
+
+        // The last message decided and what it got
+        uint64_t stamp;
+        bool verdict;
+    };
+
+    std::vector<entry> entries;
+    size_t used;
+    uint64_t tested;
+
+    // FILTER_CHANGE: the last value let through, by ID and topic
+    std::unordered_map<uint64_t, double> last;
+};
+
+#endif
@@ -0,0 +1,145 @@
+#include "event_loop.h"
+#include "helpers.h"
+
+// Flags that only mean something to epoll_ctl, multishot polls
+// already fire once per wakeup like EPOLLET does
+#define EPOLL_ONLY (EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP)
+
+EventLoop::EventLoop(int _backend) {
+    backend = _backend;
+    epfd = -1;
+    ring = nullptr;
+    ncompletions = 0;
+    generation = 0;
+
+    if (backend == LOOP_URING) {
+        ring = new Uring(URING_ENTRIES);
+        return;
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    DIE(epfd < 0, "epoll_create1");
+}
+
+EventLoop::~EventLoop() {
+    delete ring;
+    if (epfd >= 0)
+        close(epfd);
+}
+
+void EventLoop::arm(int fd) {
+    struct io_uring_sqe *sqe = ring->sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = masks[fd] & ~EPOLL_ONLY;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = LOOP_TAG_POLL | ((uint64_t)polls[fd] << 32) | (uint32_t)fd;
+}
+
+int EventLoop::add(int fd, uint32_t events) {
+    if (ring) {
+        if ((size_t)fd >= polls.size()) {
+            polls.resize(fd + 1, 0);
+            masks.resize(fd + 1, 0);
+        }
+        if (polls[fd]) {
+            errno = EEXIST;
+            return -1;
+        }
+
+        // Generations take the 31 bits between the fd and LOOP_TAG_POLL
+        // and skip 0, which means there's no poll
+        generation = (generation + 1) & 0x7fffffff;
+        if (!generation)
+            generation = 1;
+        polls[fd] = generation;
+        masks[fd] = events;
+        arm(fd);
+        return 0;
+    }
+
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int EventLoop::modify(int fd, uint32_t events) {
+    if (ring) {
+        if (remove(fd) < 0)
+            return -1;
+        return add(fd, events);
+    }
+
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int EventLoop::remove(int fd) {
+    if (ring) {
+        if ((size_t)fd >= polls.size() || !polls[fd]) {
+            errno = ENOENT;
+            return -1;
+        }
+        polls[fd] = 0;
+        cancel(fd);
+        return 0;
+    }
+
+    return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EventLoop::cancel(int fd) {
+    // Cancelling looks the fd up when it runs, so it's submitted
+    // right away while the fd still means the same file
+    struct io_uring_sqe *sqe = ring->sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = LOOP_TAG_POLL;
+    DIE(ring->enter(0, 0) < 0, "io_uring_enter");
+}
+
+int EventLoop::wait(int timeout) {
+    if (!ring) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+
+        // A signal isn't an error, just nothing happened this time
+        if (n < 0 && errno == EINTR)
+            return 0;
+        DIE(n < 0, "epoll_wait");
+        return n;
+    }
+
+    // Whatever was queued since the last round goes in with the wait
+    DIE(ring->enter(ring->ready() ? 0 : 1, timeout) < 0, "io_uring_enter");
+
+    int n = 0;
+    unsigned i, ready = ring->ready();
+    ncompletions = 0;
+    for (i = 0; i < ready && n < MAX_EVENTS && ncompletions < MAX_EVENTS; i++) {
+        const struct io_uring_cqe *cqe = ring->cqe(i);
+        if (!(cqe->user_data & LOOP_TAG_POLL)) {
+            completions[ncompletions++] = {cqe->user_data, cqe->res, cqe->flags};
+            continue;
+        }
+
+        // Cancellations and polls that were replaced since
+        auto fd = (int)(uint32_t)cqe->user_data;
+        auto gen = (uint32_t)((cqe->user_data & ~LOOP_TAG_POLL) >> 32);
+        if (!gen || (size_t)fd >= polls.size() || polls[fd] != gen)
+            continue;
+
+        if (cqe->res > 0) {
+            events[n].events = cqe->res;
+            events[n++].data.fd = fd;
+        }
+
+        // The kernel gave up on the multishot poll, ask again
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            arm(fd);
+    }
+    ring->seen(i);
+    return n;
+}
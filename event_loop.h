@@ -0,0 +1,83 @@
+#ifndef _EVENT_LOOP_H
+#define _EVENT_LOOP_H 1
+
+#include <cstdint>
+#include <vector>
+#include <sys/epoll.h>
+#include "uring.h"
+
+// How many ready file descriptors a single wait() can report
+#define MAX_EVENTS 256
+
+// What waits for the file descriptors
+#define LOOP_EPOLL 0
+#define LOOP_URING 1
+
+// Submission queue of the io_uring backend
+#define URING_ENTRIES 1024
+
+// Tags of io_uring operations queued by the caller must stay below
+// this, the ones above are the loop's own polls
+#define LOOP_TAG_POLL (1ull << 63)
+
+// How an io_uring operation queued by the caller finished
+struct completion {
+    uint64_t tag;
+    int res;
+    uint32_t flags;
+};
+
+// Thin wrapper over epoll, wait() blocks until something is ready
+// and the caller walks over events[0..n) to handle each ready fd.
+// Only the fds that are actually ready get reported, so a wakeup costs
+// O(active) no matter how many fds are registered.
+// The io_uring backend does the same with multishot polls, and every
+// other operation the caller queued on ring is submitted along with
+// them, one system call per wait() for all of it. What those
+// operations finished with ends up in completions.
+class EventLoop {
+public:
+    int backend;
+
+    // epoll instance
+    int epfd;
+
+    // nullptr unless the backend is io_uring
+    Uring *ring;
+
+    // ready events filled by wait()
+    struct epoll_event events[MAX_EVENTS];
+
+    // io_uring operations that finished, filled by wait()
+    struct completion completions[MAX_EVENTS];
+    int ncompletions;
+
+    explicit EventLoop(int backend = LOOP_EPOLL);
+    ~EventLoop();
+
+    // Register, change or drop the events we want for fd
+    // They return -1 and set errno on failure, just like epoll_ctl.
+    // With io_uring remove() also cancels every operation on fd, and
+    // it has to be called before fd is closed.
+    int add(int fd, uint32_t events);
+    int modify(int fd, uint32_t events);
+    int remove(int fd);
+
+    // io_uring only, cancels every operation on fd (polls included)
+    void cancel(int fd);
+
+    // Blocks for up to timeout ms (-1 waits forever) and returns how
+    // many entries of events are filled in
+    int wait(int timeout);
+
+private:
+    // Generation of the poll on every fd, 0 when there's none.
+    // Completions of an older poll on a reused fd are ignored
+    std::vector<uint32_t> polls;
+    std::vector<uint32_t> masks;
+    uint32_t generation;
+
+    void arm(int fd);
+};
+
+#endif
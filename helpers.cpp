@@ -1,3 +1,5 @@
+#include <endian.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
 #include "helpers.h"
 
@@ -9,45 +11,44 @@ struct pollfd new_fd(int fd, short int events) {
     return pollfd;
 }
 
+// true if the last call failed only because a non blocking fd wasn't ready
+static bool would_block() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Blocks until fd is ready for events, used to finish a packet
+// that is already halfway through on a non blocking socket
+static int wait_fd(int fd, short int events) {
+    struct pollfd pollfd = new_fd(fd, events);
+    int ret;
+    do {
+        ret = poll(&pollfd, 1, -1);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    DIE(flags < 0, "fcntl");
+    DIE(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0, "fcntl");
+}
+
+// Sends everything, on a non blocking socket it waits for room
+// in the send buffer instead of giving up
 ssize_t send_packet(int socket, char *data, size_t data_size) {
     ssize_t sent = 0, n;
     while (sent != data_size) {
-        n = send(socket, data + sent, data_size - sent, 0);
-        if (n < 0)
+        n = send(socket, data + sent, data_size - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (would_block() && wait_fd(socket, POLLOUT) >= 0)
+                continue;
             return -1;
+        }
         sent += n;
     }
     return sent;
 }
 
-ssize_t recv_packet(int socket, char *buffer, size_t data_size) {
-    ssize_t received = 0, n;
-    while (received != data_size) {
-        n = recv(socket, buffer + received, data_size - received, 0);
-        if (n < 0)
-            return -1;
-        if (n == 0)
-            break;
-        received += n;
-    }
-    return received;
-}
-
-// receives packet up to line delimitor '\n'
-ssize_t recv_variable(int socket, char *buffer, size_t buffer_len) {
-    ssize_t received = 0, n;
-    while (!(strstr(buffer, "\n"))) {
-        n = recv(socket, buffer + received, buffer_len - received, 0);
-        if (n < 0)
-            return -1;
-        if (n == 0)
-            break;
-        received += n;
-    }
-    buffer[strcspn(buffer, "\r\n")] = 0;
-    return received;
-}
-
 void set_socket_options(int sockfd) {
     // Enable a few options
     int ret, enable = 1;
@@ -55,11 +56,151 @@ void set_socket_options(int sockfd) {
     ret = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
     DIE(ret < 0, "Reuseaddr failed");
 
-    // Disable Nagle's Algorithm
+    // Writes are already batched by whoever makes them, so the kernel
+    // shouldn't hold them back: disable Nagle's Algorithm
     ret = setsockopt(sockfd, SOL_TCP, TCP_NODELAY, &enable, sizeof(int));
     DIE(ret < 0, "Nagle failed");
 
-    // Disable TCP Corking
-    ret = setsockopt(sockfd, SOL_TCP, TCP_CORK, &enable, sizeof(int));
+    // Disable TCP Corking, it would sit on every partial segment for 200ms
+    int disable = 0;
+    ret = setsockopt(sockfd, SOL_TCP, TCP_CORK, &disable, sizeof(int));
     DIE(ret < 0, "Cork failed");
-}
\ No newline at end of file
+}
+
+// Number of payload bytes that actually matter for a packet, available
+// is how many payload bytes were received from the publisher
+size_t payload_size(const packet *p, size_t available) {
+    size_t size;
+    switch (p->data_t) {
+        case PACKET_INT:
+            size = sizeof(packet_int);
+            break;
+        case PACKET_SHORT_REAL:
+            size = sizeof(packet_short_real);
+            break;
+        case PACKET_FLOAT:
+            size = sizeof(packet_float);
+            break;
+        default:
+            // strings and replies stop at the first '\0'
+            return strnlen(p->payload, std::min(available, (size_t)PAYLOAD_LEN));
+    }
+    return std::min(size, available);
+}
+
+// The number an INT, SHORT_REAL or FLOAT packet holds, false for
+// strings and for payloads too short to hold their type
+bool packet_number(const packet *p, size_t payload_len, double *value) {
+    if (p->data_t > PACKET_FLOAT || payload_len < payload_size(p, PAYLOAD_LEN))
+        return false;
+
+    if (p->data_t == PACKET_INT) {
+        auto *p_int = (const packet_int *)p->payload;
+        double val = ntohl(p_int->val);
+        *value = p_int->sign == 1 ? -val : val;
+    } else if (p->data_t == PACKET_SHORT_REAL) {
+        auto *p_short_real = (const packet_short_real *)p->payload;
+        *value = ntohs(p_short_real->val) / 100.0;
+    } else {
+        auto *p_float = (const packet_float *)p->payload;
+        // A single division, so "=23.7" matches 237 with a power of 1
+        double scale = 1;
+        for (int i = 0; i < p_float->power; i++)
+            scale *= 10;
+        double val = ntohl(p_float->val) / scale;
+        *value = p_float->sign == 1 ? -val : val;
+    }
+    return true;
+}
+
+// Writes a compact frame for the packet into out (at least MAX_FRAME_LEN
+// bytes long) and returns how many bytes it takes on the wire
+size_t encode_frame(char *out, const packet *p, size_t payload_len) {
+    auto *header = (frame_header *)out;
+    size_t topic_len = strnlen(p->topic, TOPIC_LEN);
+    size_t frame_len = sizeof(frame_header) + topic_len + payload_len;
+
+    header->len = htons(frame_len - sizeof(header->len));
+    header->version = FRAME_V2;
+    header->data_t = p->data_t;
+    header->topic_len = topic_len;
+    header->addr = p->cli_addr.sin_addr.s_addr;
+    header->port = p->cli_addr.sin_port;
+
+    memcpy(out + sizeof(frame_header), p->topic, topic_len);
+    memcpy(out + sizeof(frame_header) + topic_len, p->payload, payload_len);
+    return frame_len;
+}
+
+// Bytes that go on the wire for p, legacy clients get the packet as is
+// and everyone else a compact frame encoded into frame
+const char *wire_bytes(int version, const packet *p, size_t payload_len,
+                       char *frame, size_t *len) {
+    if (version == FRAME_LEGACY) {
+        *len = sizeof(packet);
+        return (const char *)p;
+    }
+    *len = encode_frame(frame, p, payload_len);
+    return frame;
+}
+
+// Turns a version 2 frame into a version 3 one with seq in out
+// (MAX_FRAME_LEN bytes), returns how long it got
+size_t sequence_frame(char *out, const char *frame, size_t frame_len, uint64_t seq) {
+    auto *header = (frame_header *)out;
+    memcpy(out, frame, sizeof(frame_header));
+    header->len = htons(ntohs(header->len) + FRAME_SEQ_LEN);
+    header->version = FRAME_V3;
+
+    uint64_t net = htobe64(seq);
+    memcpy(out + sizeof(frame_header), &net, FRAME_SEQ_LEN);
+    memcpy(out + sizeof(frame_header) + FRAME_SEQ_LEN, frame + sizeof(frame_header),
+           frame_len - sizeof(frame_header));
+    return frame_len + FRAME_SEQ_LEN;
+}
+
+// Unpacks a whole compact frame into p, the topic and payload are '\0'
+// terminated whenever there is room left for it. seq gets the sequence
+// number of a version 3 frame, 0 for the others.
+// Returns the payload length or -1 with EPROTO if the frame is bad
+int decode_frame(const char *frame, size_t frame_len, packet *p, uint64_t *seq) {
+    auto *header = (const frame_header *)frame;
+    if (frame_len < sizeof(frame_header) ||
+        frame_len != sizeof(header->len) + ntohs(header->len)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    size_t extra = header->version == FRAME_V3 ? FRAME_SEQ_LEN : 0;
+    if (frame_len < sizeof(frame_header) + extra + header->topic_len) {
+        errno = EPROTO;
+        return -1;
+    }
+    size_t payload_len = frame_len - sizeof(frame_header) - extra - header->topic_len;
+    if (header->topic_len > TOPIC_LEN || payload_len > PAYLOAD_LEN) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (seq) {
+        uint64_t net = 0;
+        if (extra)
+            memcpy(&net, frame + sizeof(frame_header), FRAME_SEQ_LEN);
+        *seq = be64toh(net);
+    }
+    frame += extra;
+
+    memcpy(p->topic, frame + sizeof(frame_header), header->topic_len);
+    if (header->topic_len < TOPIC_LEN)
+        p->topic[header->topic_len] = 0;
+
+    memcpy(p->payload, frame + sizeof(frame_header) + header->topic_len, payload_len);
+    if (payload_len < PAYLOAD_LEN)
+        p->payload[payload_len] = 0;
+
+    p->data_t = header->data_t;
+    p->cli_addr.sin_family = AF_INET;
+    p->cli_addr.sin_addr.s_addr = header->addr;
+    p->cli_addr.sin_port = header->port;
+    return (int)payload_len;
+}
@@ -1,75 +1,118 @@
-#ifndef _HELPERS_H
-#define _HELPERS_H 1
-
-#include <algorithm>
-#include <arpa/inet.h>
-#include <exception>
-#include <iostream>
-#include <netinet/in.h>
-#include <poll.h>
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include <unordered_map>
-#include <vector>
-
-/*
- * Macro de verificare a erorilor
- * Exemplu:
- *     int fd = open(file_name, O_RDONLY);
- *     DIE(fd == -1, "open failed");
- */
-
-#define DIE(assertion, call_description)	\
-	do {									\
-		if (assertion) {					\
-			fprintf(stderr, "(%s, %d): ",	\
-					__FILE__, __LINE__);	\
-			perror(call_description);		\
-			exit(EXIT_FAILURE);				\
-		}									\
-	} while(0)
-
-#define BUFLEN 4096
-#define QUEUE_LEN 64
-
-#define PACKET_INT 0
-#define PACKET_SHORT_REAL 1
-#define PACKET_FLOAT 2
-#define PACKET_STRING 3
-#define PACKET_REPLY 4
-
-#define CLIENT_DISCONNECTED -1
-
-typedef struct __attribute__((__packed__)) packet {
-    char topic[50];
-    uint8_t data_t;
-    char payload[1500];
-    struct sockaddr_in cli_addr;
-} packet;
-
-typedef struct __attribute__((__packed__)) packet_float {
-    char sign;
-    uint32_t val;
-    uint8_t power;
-} packet_float;
-
-typedef struct __attribute__((__packed__)) packet_short_real {
-    uint16_t val;
-} packet_short_real;
-
-typedef struct __attribute__((__packed__)) packet_int {
-    char sign;
-    uint32_t val;
-} packet_int;
-
-struct pollfd new_fd(int fd, short int events);
-ssize_t send_packet(int socket, char *data, size_t data_size);
-ssize_t recv_packet(int socket, char *buffer, size_t data_size);
-ssize_t recv_variable(int socket, char *buffer, size_t buffer_len);
-void set_socket_options(int sockfd);
-
-#endif
+#ifndef _HELPERS_H
+#define _HELPERS_H 1
+
+#include <algorithm>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <exception>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Macro de verificare a erorilor
+ * Exemplu:
+ *     int fd = open(file_name, O_RDONLY);
+ *     DIE(fd == -1, "open failed");
+ */
+
+#define DIE(assertion, call_description)	\
+	do {									\
+		if (assertion) {					\
+			fprintf(stderr, "(%s, %d): ",	\
+					__FILE__, __LINE__);	\
+			perror(call_description);		\
+			exit(EXIT_FAILURE);				\
+		}									\
+	} while(0)
+
+#define BUFLEN 4096
+#define QUEUE_LEN 64
+
+#define PACKET_INT 0
+#define PACKET_SHORT_REAL 1
+#define PACKET_FLOAT 2
+#define PACKET_STRING 3
+#define PACKET_REPLY 4
+#define PACKET_HELLO 5
+
+#define CLIENT_DISCONNECTED -1
+
+#define TOPIC_LEN 50
+#define PAYLOAD_LEN 1500
+
+// Publishers send the topic and the data type before the payload
+#define DATAGRAM_HEADER_LEN (TOPIC_LEN + 1)
+
+// Wire format versions, agreed on during the ID handshake
+// Old clients only send their ID and get the whole packet struct,
+// newer ones append the highest version they understand to the ID.
+// Version 3 clients also get the sequence number of every message on
+// their store and forward topics, and acknowledge them
+#define FRAME_LEGACY 1
+#define FRAME_V2 2
+#define FRAME_V3 3
+#define FRAME_VERSION FRAME_V3
+
+typedef struct __attribute__((__packed__)) packet {
+    char topic[TOPIC_LEN];
+    uint8_t data_t;
+    char payload[PAYLOAD_LEN];
+    struct sockaddr_in cli_addr;
+} packet;
+
+// Header of a compact frame, it's followed by topic_len bytes of topic
+// and then the payload, len counts every byte after the len field.
+// Version 3 frames have a 64 bit sequence number between the header
+// and the topic. Every field is in network order.
+typedef struct __attribute__((__packed__)) frame_header {
+    uint16_t len;
+    uint8_t version;
+    uint8_t data_t;
+    uint8_t topic_len;
+    uint32_t addr;
+    uint16_t port;
+} frame_header;
+
+#define FRAME_SEQ_LEN sizeof(uint64_t)
+#define MAX_FRAME_LEN (sizeof(frame_header) + FRAME_SEQ_LEN + TOPIC_LEN + PAYLOAD_LEN)
+
+// Most bytes a packet takes on the wire in any version
+#define MAX_WIRE_LEN (sizeof(packet) > MAX_FRAME_LEN ? sizeof(packet) : MAX_FRAME_LEN)
+
+typedef struct __attribute__((__packed__)) packet_float {
+    char sign;
+    uint32_t val;
+    uint8_t power;
+} packet_float;
+
+typedef struct __attribute__((__packed__)) packet_short_real {
+    uint16_t val;
+} packet_short_real;
+
+typedef struct __attribute__((__packed__)) packet_int {
+    char sign;
+    uint32_t val;
+} packet_int;
+
+struct pollfd new_fd(int fd, short int events);
+ssize_t send_packet(int socket, char *data, size_t data_size);
+void set_socket_options(int sockfd);
+void set_nonblocking(int fd);
+size_t payload_size(const packet *p, size_t available);
+bool packet_number(const packet *p, size_t payload_len, double *value);
+size_t encode_frame(char *out, const packet *p, size_t payload_len);
+const char *wire_bytes(int version, const packet *p, size_t payload_len,
+                       char *frame, size_t *len);
+size_t sequence_frame(char *out, const char *frame, size_t frame_len, uint64_t seq);
+int decode_frame(const char *frame, size_t frame_len, packet *p, uint64_t *seq = nullptr);
+
+#endif
@@ -0,0 +1,40 @@
+#include "message.h"
+
+message *message_new(PacketPool *pool) {
+    message *m = pool ? pool->alloc() : nullptr;
+    if (!m) {
+        m = new message();
+        m->pool = nullptr;
+    }
+    m->refs.store(1, std::memory_order_relaxed);
+    m->from_peer = 0;
+    return m;
+}
+
+void message_get(message *m) {
+    m->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void message_put(message *m) {
+    if (m->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    if (m->pool)
+        m->pool->release(m);
+    else
+        delete m;
+}
+
+void message_encode(message *m) {
+    m->frame_len = encode_frame(m->frame, &m->pkt, m->payload_len);
+    m->numeric = packet_number(&m->pkt, m->payload_len, &m->value);
+}
+
+const char *message_wire(const message *m, int version, size_t *len) {
+    if (version == FRAME_LEGACY) {
+        *len = sizeof(packet);
+        return (const char *)&m->pkt;
+    }
+    *len = m->frame_len;
+    return m->frame;
+}
@@ -0,0 +1,62 @@
+#ifndef _MESSAGE_H
+#define _MESSAGE_H 1
+
+#include <atomic>
+#include "helpers.h"
+#include "packet_pool.h"
+#include <linux/io_uring.h>
+
+// What multishot recvmsg writes before the datagram
+#define RECV_HEADER_LEN (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in))
+
+// A published packet that can be shared between workers,
+// whoever drops the last reference frees it
+struct message {
+    std::atomic<int> refs;
+
+    // Pool the message goes back to, nullptr if it came from the heap,
+    // and where in the pool it sits
+    PacketPool *pool;
+    uint32_t slot;
+
+    // how many payload bytes the data type actually needs
+    size_t payload_len;
+
+    // Forwarded by another broker, so it doesn't go back to any
+    int from_peer;
+
+    // The number the payload holds, decoded once for every content
+    // filter that looks at it. numeric is 0 for strings
+    int numeric;
+    double value;
+
+    // io_uring's multishot recvmsg puts its own header and the sender's
+    // address in front of the datagram, so they land here and the
+    // datagram lands in pkt
+    char recv_header[RECV_HEADER_LEN];
+
+    packet pkt;
+
+    // The compact frame, encoded once when the message came in and
+    // never written again, so every queue can point straight at it
+    size_t frame_len;
+    char frame[MAX_FRAME_LEN];
+};
+
+static_assert(offsetof(message, pkt) == offsetof(message, recv_header) + RECV_HEADER_LEN,
+              "recv_header has to end right where pkt starts");
+
+// Takes a message holding a single reference out of pool, or from
+// the heap if the pool ran dry
+message *message_new(PacketPool *pool);
+void message_get(message *m);
+void message_put(message *m);
+
+// Fills in frame (and the decoded value) once pkt and payload_len are final
+void message_encode(message *m);
+
+// What goes on the wire for a client speaking version, legacy clients
+// get the packet as is
+const char *message_wire(const message *m, int version, size_t *len);
+
+#endif
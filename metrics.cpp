@@ -0,0 +1,184 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+
+using namespace std;
+
+uint64_t histogram::percentile(double p) const {
+    if (!count)
+        return 0;
+
+    auto rank = (uint64_t)(p * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return min(1ull << i, (unsigned long long)max);
+    }
+    return max;
+}
+
+static void appendf(string &out, const char *format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    out += buffer;
+}
+
+// Escapes what JSON can't hold in a string, topics and IDs come
+// straight from the network
+static void append_json_string(string &out, const string &s) {
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (c < 0x20)
+            appendf(out, "\\u%04x", c);
+        else
+            out += (char)c;
+    }
+    out += '"';
+}
+
+static void append_histogram(string &out, const char *name, const histogram &h) {
+    appendf(out, "  %-7s %10lu samples  avg %8.1fus  p50 %8.1fus  p99 %8.1fus"
+                 "  p999 %8.1fus  max %8.1fus\n",
+            name, h.count, h.count ? h.sum / 1000.0 / h.count : 0.0,
+            h.percentile(0.5) / 1000.0, h.percentile(0.99) / 1000.0,
+            h.percentile(0.999) / 1000.0, h.max / 1000.0);
+}
+
+static void append_histogram_json(string &out, const char *name, const histogram &h) {
+    appendf(out, "\"%s\":{\"count\":%lu,\"sum_ns\":%lu,\"max_ns\":%lu,"
+                 "\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"buckets\":[",
+            name, h.count, h.sum, h.max, h.percentile(0.5), h.percentile(0.99),
+            h.percentile(0.999));
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        appendf(out, i ? ",%lu" : "%lu", h.buckets[i]);
+    out += "]}";
+}
+
+string format_stats(vector<worker_stats> &stats) {
+    string out;
+
+    for (auto &w : stats) {
+        const worker_metrics &m = w.metrics;
+        appendf(out, "Worker %d: %lu datagrams (%lu malformed), %lu sent to other workers"
+                     " (%lu dropped)\n",
+                w.index, m.datagrams, m.malformed, m.mailed, m.mail_dropped);
+        appendf(out, "  %lu frames (%lu bytes) queued, %lu writes, %lu dropped,"
+                     " %lu slow clients kicked, %lu spills, %lu logged\n",
+                m.deliveries, m.delivered_bytes, m.writes, m.dropped, m.kicked, m.spills, m.logged);
+        appendf(out, "  store and forward: %lu dropped by quota, %lu expired, %lu spilled\n",
+                m.sf_dropped, m.sf_expired, m.sf_spilled);
+        appendf(out, "  %lu connects (%lu refused), %lu disconnects, %lu replays (%lu bytes),"
+                     " %lu acks, %lu zerocopy writes\n",
+                m.connects, m.refused, m.disconnects, m.replays, m.replayed_bytes, m.acks,
+                m.zerocopy);
+        appendf(out, "  federation: %lu messages from peers, %lu frames to peers\n",
+                m.from_peers, m.to_peers);
+        append_histogram(out, "ingest", m.ingest);
+        append_histogram(out, "fanout", m.fanout);
+        append_histogram(out, "replay", m.replay);
+        appendf(out, "  %zu of %zu pooled messages in use (%zu bytes), %zu bytes queued,"
+                     " %zu log entries (%zu bytes held)\n",
+                w.pool_in_use, w.pool_size, w.message_bytes, w.queued_bytes, w.log_entries,
+                w.log_bytes);
+        appendf(out, "  %zu content filters, %lu tests, %lu frames filtered out\n",
+                w.filters, w.filter_checks, m.filtered);
+        appendf(out, "  %zu retained topics (%zu bytes)\n", w.retained, w.retained_bytes);
+        appendf(out, "  %d pool slabs, %ld of %zu slab bytes in use\n",
+                w.pool_slabs, w.slab_in_use, w.slab_reserved);
+
+        // Busiest topics and the clients furthest behind
+        sort(w.topics.begin(), w.topics.end(),
+             [](const topic_stats &a, const topic_stats &b) { return a.messages > b.messages; });
+        for (size_t i = 0; i < w.topics.size() && i < STATS_TOP; i++)
+            appendf(out, "  topic %s: %lu messages, %lu bytes\n",
+                    w.topics[i].topic.c_str(), w.topics[i].messages, w.topics[i].bytes);
+
+        sort(w.clients.begin(), w.clients.end(), [](const client_stats &a, const client_stats &b) {
+            return a.queued + a.backlog > b.queued + b.backlog;
+        });
+        for (size_t i = 0; i < w.clients.size() && i < STATS_TOP; i++) {
+            const client_stats &c = w.clients[i];
+            appendf(out, "  client %s: %s%s, queue %zu/%zu, socket %d/%d, backlog %lu",
+                    c.id.c_str(), c.online ? "online" : "away",
+                    c.replaying ? " replaying" : c.spilling ? " spilling" : "", c.queued,
+                    c.queue_limit, c.sndbuf_used, c.sndbuf_size, c.backlog);
+            if (c.replaying)
+                appendf(out, " (%lu replayed)", c.replayed);
+            out += '\n';
+        }
+        if (w.clients.size() > STATS_TOP)
+            appendf(out, "  and %zu more clients\n", w.clients.size() - STATS_TOP);
+    }
+    return out;
+}
+
+string format_stats_json(const vector<worker_stats> &stats) {
+    string out = "{\"workers\":[";
+
+    for (size_t i = 0; i < stats.size(); i++) {
+        const worker_stats &w = stats[i];
+        const worker_metrics &m = w.metrics;
+        if (i)
+            out += ',';
+
+        appendf(out, "{\"index\":%d,\"datagrams\":%lu,\"malformed\":%lu,\"mailed\":%lu,"
+                     "\"deliveries\":%lu,\"delivered_bytes\":%lu,\"writes\":%lu,\"dropped\":%lu,"
+                     "\"kicked\":%lu,\"spills\":%lu,\"logged\":%lu,\"connects\":%lu,"
+                     "\"disconnects\":%lu,\"replays\":%lu,\"replayed_bytes\":%lu,\"acks\":%lu,"
+                     "\"zerocopy\":%lu,",
+                w.index, m.datagrams, m.malformed, m.mailed, m.deliveries,
+                m.delivered_bytes, m.writes, m.dropped, m.kicked, m.spills, m.logged, m.connects,
+                m.disconnects, m.replays, m.replayed_bytes, m.acks, m.zerocopy);
+        appendf(out, "\"mail_dropped\":%lu,\"refused\":%lu,", m.mail_dropped, m.refused);
+        appendf(out, "\"from_peers\":%lu,\"to_peers\":%lu,", m.from_peers, m.to_peers);
+        appendf(out, "\"filters\":%zu,\"filter_checks\":%lu,\"filtered\":%lu,",
+                w.filters, w.filter_checks, m.filtered);
+        appendf(out, "\"sf_dropped\":%lu,\"sf_expired\":%lu,\"sf_spilled\":%lu,"
+                     "\"log_bytes\":%zu,\"retained\":%zu,\"retained_bytes\":%zu,",
+                m.sf_dropped, m.sf_expired, m.sf_spilled, w.log_bytes, w.retained,
+                w.retained_bytes);
+        appendf(out, "\"pool_in_use\":%zu,\"pool_size\":%zu,\"message_bytes\":%zu,"
+                     "\"queued_bytes\":%zu,\"log_entries\":%zu,\"pool_slabs\":%d,"
+                     "\"slab_reserved\":%zu,\"slab_in_use\":%ld,",
+                w.pool_in_use, w.pool_size, w.message_bytes, w.queued_bytes, w.log_entries,
+                w.pool_slabs, w.slab_reserved, w.slab_in_use);
+
+        append_histogram_json(out, "ingest", m.ingest);
+        out += ',';
+        append_histogram_json(out, "fanout", m.fanout);
+        out += ',';
+        append_histogram_json(out, "replay", m.replay);
+
+        out += ",\"topics\":[";
+        for (size_t j = 0; j < w.topics.size(); j++) {
+            out += j ? ",{\"topic\":" : "{\"topic\":";
+            append_json_string(out, w.topics[j].topic);
+            appendf(out, ",\"messages\":%lu,\"bytes\":%lu}",
+                    w.topics[j].messages, w.topics[j].bytes);
+        }
+
+        out += "],\"clients\":[";
+        for (size_t j = 0; j < w.clients.size(); j++) {
+            const client_stats &c = w.clients[j];
+            out += j ? ",{\"id\":" : "{\"id\":";
+            append_json_string(out, c.id);
+            appendf(out, ",\"online\":%s,\"spilling\":%s,\"queued\":%zu,\"queue_limit\":%zu,"
+                         "\"sndbuf_used\":%d,\"sndbuf_size\":%d,\"backlog\":%lu,"
+                         "\"replaying\":%s,\"replayed\":%lu}",
+                    c.online ? "true" : "false", c.spilling ? "true" : "false",
+                    c.queued, c.queue_limit, c.sndbuf_used, c.sndbuf_size, c.backlog,
+                    c.replaying ? "true" : "false", c.replayed);
+        }
+        out += "]}";
+    }
+
+    out += "]}\n";
+    return out;
+}
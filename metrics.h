@@ -0,0 +1,140 @@
+#ifndef _METRICS_H
+#define _METRICS_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <time.h>
+
+// Bucket i of a histogram counts the samples below 2^i ns,
+// the last one takes everything longer
+#define HISTOGRAM_BUCKETS 40
+
+// How many topics and clients the stats command lists per worker,
+// the admin socket gets all of them
+#define STATS_TOP 10
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Latency histogram with power of two buckets, recording a sample
+// is a handful of adds
+struct histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count, sum, max;
+
+    void record(uint64_t ns) {
+        int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+        buckets[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+        count++;
+        sum += ns;
+        if (ns > max)
+            max = ns;
+    }
+
+    // Upper bound in ns of the bucket holding the p-th sample
+    uint64_t percentile(double p) const;
+};
+
+// Counters of one worker. Only the worker itself ever touches them and
+// snapshots are taken on its own thread, so they are plain adds with
+// no atomics or locks.
+struct worker_metrics {
+    uint64_t datagrams;         // read from the UDP socket
+    uint64_t malformed;         // too short to be forwarded
+    uint64_t mailed;            // handed to other workers
+    uint64_t mail_dropped;      // for a worker too far behind to take them
+    uint64_t deliveries;        // frames queued for subscribers
+    uint64_t delivered_bytes;
+    uint64_t writes;            // writes to subscriber sockets
+    uint64_t dropped;           // frames thrown away by OVERFLOW_DROP
+    uint64_t kicked;            // clients dropped by OVERFLOW_DISCONNECT
+    uint64_t spills;            // times a client started spilling
+    uint64_t logged;            // entries appended to store and forward logs
+    uint64_t sf_dropped;        // log entries lost to a quota
+    uint64_t sf_expired;        // log entries that ran out of time
+    uint64_t sf_spilled;        // log entries moved to the spill directory
+    uint64_t connects;
+    uint64_t refused;           // connections closed for lack of fds
+    uint64_t disconnects;
+    uint64_t replays;           // reconnects that had a backlog
+    uint64_t replayed_bytes;
+    uint64_t acks;              // acknowledgements that moved a cursor
+    uint64_t zerocopy;          // MSG_ZEROCOPY writes the kernel finished
+    uint64_t from_peers;        // messages other brokers forwarded to us
+    uint64_t to_peers;          // frames queued for other brokers
+    uint64_t filtered;          // frames content filters kept from subscribers
+
+    histogram ingest;           // every recvmmsg batch, read to routed
+    histogram fanout;           // every message, to all local subscribers
+    histogram replay;           // every reconnect backlog
+};
+
+struct topic_stats {
+    std::string topic;
+    uint64_t messages;
+    uint64_t bytes;
+};
+
+struct client_stats {
+    std::string id;
+    bool online;
+    bool spilling;
+
+    // Bytes in the output queue and its limit
+    size_t queued;
+    size_t queue_limit;
+
+    // Bytes the kernel still holds in the socket and how many it takes
+    int sndbuf_used;
+    int sndbuf_size;
+
+    // Store and forward entries still to be sent
+    uint64_t backlog;
+
+    // Catching up after a reconnect, and what it got from that so far
+    bool replaying;
+    uint64_t replayed;
+};
+
+// Everything a worker reports about itself
+struct worker_stats {
+    int index;
+    worker_metrics metrics;
+    std::vector<topic_stats> topics;
+    std::vector<client_stats> clients;
+
+    // Messages taken from the pool (in flight, in mailboxes or
+    // logged) and bytes waiting in the output queues
+    size_t pool_in_use;
+    size_t pool_size;
+    size_t message_bytes;
+    size_t queued_bytes;
+    size_t log_entries;
+    size_t log_bytes;
+
+    // Distinct content filters in use and how many times one was
+    // tested against a message
+    size_t filters;
+    uint64_t filter_checks;
+
+    // Topics with a cached last message and their frame bytes
+    size_t retained;
+    size_t retained_bytes;
+
+    // Slabs the pool has grown to, and what the worker's small block
+    // slabs have reserved and hand out right now
+    int pool_slabs;
+    size_t slab_reserved;
+    long slab_in_use;
+};
+
+// For people (the stats command) and for programs (the admin socket)
+std::string format_stats(std::vector<worker_stats> &stats);
+std::string format_stats_json(const std::vector<worker_stats> &stats);
+
+#endif
@@ -0,0 +1,270 @@
+#include "out_queue.h"
+#include "message.h"
+#include <algorithm>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// How many frames a single write looks at, so a queue full of tiny
+// frames doesn't get walked over in full on every push
+#define OUT_WALK (OUT_IOV * 16)
+
+OutQueue::OutQueue(size_t _capacity) {
+    buf = nullptr;
+    capacity = _capacity;
+    head = used = queued = sent = 0;
+    in_flight = false;
+    zc_next = 0;
+}
+
+OutQueue::~OutQueue() {
+    clear();
+    delete[] buf;
+}
+
+bool OutQueue::push(const char *data, size_t len) {
+    if (len > capacity - queued)
+        return false;
+    if (!buf)
+        buf = new char[capacity];
+
+    // Copy up to the end of the ring and wrap around for the rest
+    size_t tail = (head + used) % capacity;
+    size_t first = std::min(len, capacity - tail);
+    memcpy(buf + tail, data, first);
+    memcpy(buf, data + first, len - first);
+
+    used += len;
+    queued += len;
+    frames.push_back({(uint32_t)len, nullptr, nullptr});
+    return true;
+}
+
+bool OutQueue::push_ref(message *m, const char *data, size_t len) {
+    if (len > capacity - queued)
+        return false;
+
+    message_get(m);
+    queued += len;
+    frames.push_back({(uint32_t)len, m, data});
+    return true;
+}
+
+ssize_t OutQueue::flush(int fd, bool zerocopy) {
+    // More than OUT_IOV shared frames take several sendmsg calls, only
+    // one the socket didn't take all of means it's full
+    ssize_t written = 0;
+    while (queued) {
+        // sendmsg is writev for sockets, and it lets us skip SIGPIPE
+        struct iovec iov[OUT_IOV];
+        struct msghdr msg{};
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = start_send(iov);
+
+        // Only shared frames can be pinned, ring bytes get overwritten
+        size_t bytes = 0, run = zerocopy ? shared_run(&bytes) : 0;
+        bool pin = bytes >= ZEROCOPY_MIN;
+        if (pin) {
+            msg.msg_iovlen = std::min(msg.msg_iovlen, run);
+            flags |= MSG_ZEROCOPY;
+        }
+
+        size_t offered = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; i++)
+            offered += iov[i].iov_len;
+        ssize_t n = sendmsg(fd, &msg, flags);
+
+        // The kernel numbers every zerocopy send that went through and
+        // reads from these until it says it's done with that number
+        if (pin && n >= 0) {
+            size_t left = n, skip = sent;
+            for (size_t i = 0; i < run && left; i++) {
+                message_get(frames[i].ref);
+                zc_pinned.emplace_back(zc_next, frames[i].ref);
+                left -= std::min(left, frames[i].len - skip);
+                skip = 0;
+            }
+            zc_next++;
+        }
+
+        finish_send(n);
+        if (n < 0)
+            return written ? written : n;
+        written += n;
+        if (!n || (size_t)n < offered)
+            break;
+    }
+    return written;
+}
+
+int OutQueue::reap(int fd, bool *copied) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 16];
+    int done = 0;
+
+    while (true) {
+        struct msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return done;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            auto *err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // Sends ee_info..ee_data are done, TCP finishes them in order
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                *copied = true;
+            while (!zc_pinned.empty() && (int32_t)(zc_pinned.front().first - err->ee_data) <= 0) {
+                message_put(zc_pinned.front().second);
+                zc_pinned.pop_front();
+            }
+            done += err->ee_data - err->ee_info + 1;
+        }
+    }
+}
+
+int OutQueue::start_send(struct iovec iov[OUT_IOV]) {
+    int n = 0;
+    bool ring = false, full = false;
+    size_t pos = head, skip = sent, walked = 0;
+
+    for (const frame &f : frames) {
+        if (full || ++walked > OUT_WALK)
+            break;
+        size_t len = f.len - skip;
+        skip = 0;
+
+        if (f.ref) {
+            if (n == OUT_IOV)
+                break;
+            iov[n].iov_base = (char *)f.data + f.len - len;
+            iov[n++].iov_len = len;
+            ring = false;
+            continue;
+        }
+
+        // Frames copied one after the other are one piece of the ring,
+        // or two when it wraps
+        while (len) {
+            size_t piece = std::min(len, capacity - pos);
+            if (ring && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len == buf + pos) {
+                iov[n - 1].iov_len += piece;
+            } else if (n < OUT_IOV) {
+                iov[n].iov_base = buf + pos;
+                iov[n++].iov_len = piece;
+            } else {
+                full = true;
+                break;
+            }
+            ring = true;
+            pos = (pos + piece) % capacity;
+            len -= piece;
+        }
+    }
+
+    in_flight = true;
+    return n;
+}
+
+void OutQueue::finish_send(ssize_t n) {
+    in_flight = false;
+    if (n > 0)
+        consume(n);
+}
+
+void OutQueue::consume(size_t n) {
+    while (n) {
+        frame &f = frames.front();
+        size_t take = std::min(n, f.len - sent);
+        if (!f.ref) {
+            head = (head + take) % capacity;
+            used -= take;
+        }
+        queued -= take;
+        sent += take;
+        n -= take;
+
+        // Forget the frames that made it out completely
+        if (sent == f.len) {
+            if (f.ref)
+                message_put(f.ref);
+            frames.pop_front();
+            sent = 0;
+        }
+    }
+    if (!used)
+        head = 0;
+}
+
+size_t OutQueue::shared_run(size_t *bytes) const {
+    size_t count = 0, skip = sent;
+    *bytes = 0;
+    for (const frame &f : frames) {
+        if (!f.ref || count == OUT_IOV)
+            break;
+        *bytes += f.len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+int OutQueue::drop_oldest(size_t len) {
+    int dropped = 0;
+    if (len > capacity || in_flight)
+        return -1;
+
+    // A frame that is halfway out has to finish, the next one goes instead
+    while (len > capacity - queued) {
+        size_t i = sent ? 1 : 0;
+        if (i >= frames.size())
+            return -1;
+        drop(i);
+        dropped++;
+    }
+    return dropped;
+}
+
+void OutQueue::drop(size_t i) {
+    frame f = frames[i];
+    frames.erase(frames.begin() + i);
+    queued -= f.len;
+    if (f.ref) {
+        message_put(f.ref);
+        return;
+    }
+
+    // The unsent rest of a copied first frame slides forward over it
+    size_t rest = i && !frames[0].ref ? frames[0].len - sent : 0;
+    for (size_t j = rest; j-- > 0;)
+        buf[(head + f.len + j) % capacity] = buf[(head + j) % capacity];
+
+    head = (head + f.len) % capacity;
+    used -= f.len;
+}
+
+void OutQueue::clear() {
+    for (const frame &f : frames) {
+        if (f.ref)
+            message_put(f.ref);
+    }
+
+    // The socket is gone, nobody is going to tell us about these
+    for (auto &pinned : zc_pinned)
+        message_put(pinned.second);
+    zc_pinned.clear();
+    zc_next = 0;
+
+    head = used = queued = sent = 0;
+    in_flight = false;
+    frames.clear();
+}
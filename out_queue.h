@@ -0,0 +1,115 @@
+#ifndef _OUT_QUEUE_H
+#define _OUT_QUEUE_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "slab.h"
+
+struct message;
+
+// Most iovecs a single write is made of
+#define OUT_IOV 64
+
+// Writes at least this long go out with MSG_ZEROCOPY when it's on,
+// below it pinning the pages costs more than copying them
+#define ZEROCOPY_MIN (16 * 1024)
+
+// Bounded queue of frames waiting to be written to one subscriber.
+// Published frames are shared: the queue holds a reference to the
+// message and points at its encoded bytes. Everything else (replies,
+// frames read back from the store) is copied into a ring. Everything
+// queued leaves with a single sendmsg over up to OUT_IOV iovecs,
+// whatever the socket doesn't take stays queued until it's writable
+// again.
+class OutQueue {
+public:
+    explicit OutQueue(size_t capacity);
+    ~OutQueue();
+
+    // Appends a whole frame, false if there is no room for it.
+    // push_ref() doesn't copy, data has to live inside m and the queue
+    // takes its own reference until the frame is written
+    bool push(const char *data, size_t len);
+    bool push_ref(message *m, const char *data, size_t len);
+
+    // Writes as much as the socket takes without blocking.
+    // Returns the bytes written or -1 with errno set (EAGAIN included).
+    // With zerocopy a long enough run of shared frames is sent with
+    // MSG_ZEROCOPY (the socket needs SO_ZEROCOPY) and they stay pinned
+    // until reap() hears from the kernel
+    ssize_t flush(int fd, bool zerocopy = false);
+
+    // Reads the zerocopy notifications off fd's error queue and lets go
+    // of the messages the kernel is done with. Returns how many sends
+    // completed, and copied says if the kernel had to copy them anyway
+    int reap(int fd, bool *copied);
+
+    // The same in two steps for writes that finish later (io_uring):
+    // start_send() points iov at everything queued and returns how many
+    // of the OUT_IOV it used, those bytes stay put until finish_send()
+    // says how many of them went out (n <= 0 for none)
+    int start_send(struct iovec iov[OUT_IOV]);
+    void finish_send(ssize_t n);
+    bool sending() const { return in_flight; }
+
+    // Drops queued frames, oldest first, until len more bytes fit.
+    // A frame that is partly on the wire already is never dropped,
+    // and nothing is while a write started by start_send() is going.
+    // Returns how many frames were dropped or -1 if len can't fit
+    int drop_oldest(size_t len);
+
+    // Forgets every queued frame, the ring stays around
+    void clear();
+
+    size_t size() const { return queued; }
+    size_t limit() const { return capacity; }
+    bool empty() const { return queued == 0; }
+    size_t pinned() const { return zc_pinned.size(); }
+
+private:
+    struct frame {
+        uint32_t len;
+
+        // nullptr if the bytes are in the ring
+        message *ref;
+        const char *data;
+    };
+
+    // allocated on the first copied frame, most clients never need it
+    char *buf;
+    size_t capacity;
+
+    // where the oldest byte of the ring is and how many are in it,
+    // queued also counts the shared frames
+    size_t head, used, queued;
+
+    // every queued frame and how much of the first one has already
+    // been written
+    std::deque<frame, SlabAllocator<frame>> frames;
+    size_t sent;
+
+    // Set between start_send() and finish_send()
+    bool in_flight;
+
+    // Messages the kernel may still read from, with the zerocopy send
+    // they went out with. Sends are numbered by the socket from 0
+    typedef std::pair<uint32_t, message *> pin;
+    std::deque<pin, SlabAllocator<pin>> zc_pinned;
+    uint32_t zc_next;
+
+    // Forgets the first n bytes, they were written
+    void consume(size_t n);
+
+    // Removes frames[i], only the frames before it may be in the ring
+    // ahead of its bytes
+    void drop(size_t i);
+
+    // How many of the first frames are shared and how many bytes they
+    // still have to write
+    size_t shared_run(size_t *bytes) const;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "output.h"
+
+Output::Output(int _fd, int _mode) {
+    fd = _fd;
+    mode = _mode;
+    buf = new char[OUTPUT_BUFLEN];
+    used = 0;
+}
+
+Output::~Output() {
+    flush();
+    delete[] buf;
+}
+
+char *Output::reserve(size_t len) {
+    if (len > OUTPUT_BUFLEN - used)
+        flush();
+    return buf + used;
+}
+
+void Output::commit(size_t len) {
+    used += len;
+    if (mode == OUTPUT_UNBUFFERED)
+        flush();
+}
+
+void Output::append(const char *data, size_t len) {
+    while (len) {
+        size_t chunk = std::min(len, (size_t)OUTPUT_BUFLEN);
+        memcpy(reserve(chunk), data, chunk);
+        commit(chunk);
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void Output::flush() {
+    size_t written = 0;
+    while (written < used) {
+        ssize_t n = write(fd, buf + written, used - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        DIE(n < 0, "write");
+        written += n;
+    }
+    used = 0;
+}
+
+static char *put(char *out, const char *text, size_t len) {
+    memcpy(out, text, len);
+    return out + len;
+}
+
+static char *put(char *out, const char *text) {
+    return put(out, text, strlen(text));
+}
+
+// Decimal digits of val, at least width of them (zero padded)
+static char *put_uint(char *out, uint32_t val, int width = 1) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + val % 10);
+        val /= 10;
+    } while (val);
+
+    for (; width > n; width--)
+        *out++ = '0';
+    while (n)
+        *out++ = digits[--n];
+    return out;
+}
+
+static int count_digits(uint32_t val) {
+    int n = 1;
+    while (val >= 10) {
+        val /= 10;
+        n++;
+    }
+    return n;
+}
+
+// val / 10^power with the dot where it belongs, a whole number
+// still gets ".00" after it
+static char *put_float(char *out, uint32_t val, uint8_t power) {
+    if (power == 0) {
+        out = put_uint(out, val);
+        return put(out, ".00", 3);
+    }
+
+    int digits = count_digits(val);
+    if (digits <= power) {
+        out = put(out, "0.", 2);
+        return put_uint(out, val, power);
+    }
+
+    // Split the digits around the dot
+    uint32_t scale = 1;
+    for (int i = 0; i < power; i++)
+        scale *= 10;
+    out = put_uint(out, val / scale);
+    *out++ = '.';
+    return put_uint(out, val % scale, power);
+}
+
+size_t format_packet(char *out, const packet *p) {
+    char *start = out;
+
+    // Address of the publisher, in network order already
+    auto *ip = (const uint8_t *)&p->cli_addr.sin_addr.s_addr;
+    for (int i = 0; i < 4; i++) {
+        out = put_uint(out, ip[i]);
+        *out++ = i < 3 ? '.' : ':';
+    }
+    out = put_uint(out, ntohs(p->cli_addr.sin_port));
+    out = put(out, " - ", 3);
+    out = put(out, p->topic, strnlen(p->topic, TOPIC_LEN));
+
+    if (p->data_t == PACKET_INT) {
+        auto *p_int = (const packet_int *)p->payload;
+        out = put(out, " - INT - ");
+        if (p_int->sign == 1)
+            *out++ = '-';
+        out = put_uint(out, ntohl(p_int->val));
+    } else if (p->data_t == PACKET_SHORT_REAL) {
+        // The number is the modulus times 100
+        auto *p_short_real = (const packet_short_real *)p->payload;
+        uint16_t val = ntohs(p_short_real->val);
+        out = put(out, " - SHORT_REAL - ");
+        out = put_uint(out, val / 100);
+        *out++ = '.';
+        out = put_uint(out, val % 100, 2);
+    } else if (p->data_t == PACKET_FLOAT) {
+        auto *p_float = (const packet_float *)p->payload;
+        out = put(out, " - FLOAT - ");
+        if (p_float->sign == 1)
+            *out++ = '-';
+        out = put_float(out, ntohl(p_float->val), p_float->power);
+    } else {
+        out = put(out, " - STRING - ");
+        out = put(out, p->payload, strnlen(p->payload, PAYLOAD_LEN));
+    }
+
+    *out++ = '\n';
+    return out - start;
+}
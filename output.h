@@ -0,0 +1,47 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H 1
+
+#include <cstddef>
+#include "helpers.h"
+
+// When buffered lines are written out
+#define OUTPUT_UNBUFFERED 0    // every line right away
+#define OUTPUT_BATCHED 1       // whenever flush() is called or the buffer fills up
+
+#define OUTPUT_BUFLEN (64 * 1024)
+
+// Longest line format_packet() writes, a string payload plus the
+// address, topic and type around it
+#define LINE_LEN (64 + TOPIC_LEN + PAYLOAD_LEN)
+
+// Reusable buffer of text going to a file descriptor. Lines are
+// formatted in place, so nothing is allocated per line.
+class Output {
+public:
+    Output(int fd, int mode);
+    Output(const Output &) = delete;
+    ~Output();
+
+    // Room for at least len more bytes, len must be at most OUTPUT_BUFLEN
+    char *reserve(size_t len);
+
+    // Takes the len bytes written after reserve() as a finished line
+    void commit(size_t len);
+
+    void append(const char *data, size_t len);
+
+    // Writes out everything buffered
+    void flush();
+
+private:
+    int fd;
+    int mode;
+    char *buf;
+    size_t used;
+};
+
+// Writes the human readable line for a message from a publisher,
+// at most LINE_LEN bytes, "\n" included. Returns how many bytes it took
+size_t format_packet(char *out, const packet *p);
+
+#endif
@@ -0,0 +1,87 @@
+#include "packet_pool.h"
+#include "message.h"
+
+PacketPool::PacketPool(size_t _slab_len) {
+    slab_len = _slab_len;
+    nslabs.store(0, std::memory_order_relaxed);
+    head.store(0, std::memory_order_relaxed);
+    used.store(0, std::memory_order_relaxed);
+    grow();
+}
+
+PacketPool::~PacketPool() {
+    for (int i = 0; i < nslabs.load(std::memory_order_relaxed); i++) {
+        delete[] slabs[i];
+        delete[] next[i];
+    }
+}
+
+bool PacketPool::grow() {
+    int n = nslabs.load(std::memory_order_relaxed);
+    if (n == POOL_MAX_SLABS || !slab_len)
+        return false;
+
+    auto *slab = new message[slab_len];
+    auto *links = new std::atomic<uint32_t>[slab_len];
+    uint32_t first = n * slab_len;
+    for (size_t i = 0; i < slab_len; i++) {
+        slab[i].pool = this;
+        slab[i].slot = first + i;
+        links[i].store(i + 1 < slab_len ? first + i + 2 : 0, std::memory_order_relaxed);
+    }
+    slabs[n] = slab;
+    next[n] = links;
+    nslabs.store(n + 1, std::memory_order_release);
+
+    // Releases may have refilled the list meanwhile, splice the
+    // new slots in front of whatever is there
+    std::atomic<uint32_t> &last = links[slab_len - 1];
+    uint32_t top = head.load(std::memory_order_relaxed);
+    do {
+        last.store(top, std::memory_order_relaxed);
+    } while (!head.compare_exchange_weak(top, first + 1, std::memory_order_release,
+                                         std::memory_order_relaxed));
+    return true;
+}
+
+message *PacketPool::alloc() {
+    uint32_t top = head.load(std::memory_order_acquire);
+    while (true) {
+        if (!top) {
+            if (!grow())
+                return nullptr;
+            top = head.load(std::memory_order_acquire);
+            continue;
+        }
+
+        uint32_t after = next_of(top - 1).load(std::memory_order_relaxed);
+        if (head.compare_exchange_weak(top, after, std::memory_order_acquire,
+                                       std::memory_order_acquire)) {
+            used.fetch_add(1, std::memory_order_relaxed);
+            message *slab = slabs[(top - 1) / slab_len];
+            return &slab[(top - 1) % slab_len];
+        }
+    }
+}
+
+void PacketPool::release(message *m) {
+    uint32_t slot = m->slot + 1;
+    uint32_t top = head.load(std::memory_order_relaxed);
+    do {
+        next_of(slot - 1).store(top, std::memory_order_relaxed);
+    } while (!head.compare_exchange_weak(top, slot, std::memory_order_release,
+                                         std::memory_order_relaxed));
+    used.fetch_sub(1, std::memory_order_relaxed);
+}
+
+size_t PacketPool::in_use() const {
+    return used.load(std::memory_order_relaxed);
+}
+
+size_t PacketPool::size() const {
+    return slab_count() * slab_len;
+}
+
+int PacketPool::slab_count() const {
+    return nslabs.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+#ifndef _PACKET_POOL_H
+#define _PACKET_POOL_H 1
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+struct message;
+
+// Most slabs a pool grows to, past that messages come from the heap
+#define POOL_MAX_SLABS 64
+
+// Messages owned by one worker, allocated a slab at a time.
+// Only the owner takes messages out, but any thread can put one
+// back, so the free list is a lock-free stack with a single popper
+// (which also keeps it safe from ABA without tagging the head).
+// When it runs dry the owner adds another slab; slabs are never
+// freed, every message goes back on the list it came from.
+class PacketPool {
+public:
+    explicit PacketPool(size_t slab_len);
+    ~PacketPool();
+
+    // Owner thread only, returns nullptr once every slot of the
+    // last slab is in use
+    message *alloc();
+
+    // Any thread, m must come from this pool
+    void release(message *m);
+
+    // How many slots are handed out right now, and how many there are
+    size_t in_use() const;
+    size_t size() const;
+    int slab_count() const;
+
+private:
+    size_t slab_len;
+
+    // Slab i holds slots i * slab_len onwards. Written by the owner
+    // before any of its messages leaves the thread
+    message *slabs[POOL_MAX_SLABS];
+    std::atomic<int> nslabs;
+
+    // next[i][j] is the slot after slot i * slab_len + j on the free
+    // list, heads and links are stored as index + 1 so 0 can mean empty
+    std::atomic<uint32_t> *next[POOL_MAX_SLABS];
+    std::atomic<uint32_t> head;
+    std::atomic<size_t> used;
+
+    std::atomic<uint32_t> &next_of(uint32_t slot) {
+        return next[slot / slab_len][slot % slab_len];
+    }
+
+    // Adds a slab and chains its slots on the free list, false if
+    // the pool can't grow anymore
+    bool grow();
+};
+
+#endif
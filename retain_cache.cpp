@@ -0,0 +1,95 @@
+#include "retain_cache.h"
+#include "helpers.h"
+#include "slab.h"
+
+RetainCache::RetainCache(size_t _limit) {
+    limit = _limit;
+    bytes = cached = 0;
+    head = tail = NONE;
+}
+
+RetainCache::~RetainCache() {
+    for (auto &e : entries) {
+        if (e.frame)
+            slab_free(e.frame, e.len);
+    }
+}
+
+void RetainCache::put(uint32_t topic, const char *frame, size_t len) {
+    if (topic >= entries.size())
+        entries.resize(topic + 1, entry{nullptr, 0, NONE, NONE});
+    entry &e = entries[topic];
+
+    // A frame of the same length goes where the old one was
+    if (e.frame && e.len != len)
+        evict(topic);
+    if (!e.frame) {
+        e.frame = (char *)slab_alloc(len);
+        e.len = len;
+        bytes += len;
+        cached++;
+    } else {
+        unlink(topic);
+    }
+    memcpy(e.frame, frame, len);
+    push_front(topic);
+
+    // A single frame over the limit doesn't stay either
+    while (bytes > limit)
+        evict(tail);
+}
+
+const char *RetainCache::get(uint32_t topic, size_t *len) {
+    if (topic >= entries.size() || !entries[topic].frame)
+        return nullptr;
+    unlink(topic);
+    push_front(topic);
+    *len = entries[topic].len;
+    return entries[topic].frame;
+}
+
+const char *RetainCache::wire(uint32_t topic, int version, char *buffer, size_t *len) {
+    const char *frame = get(topic, len);
+    if (!frame || version != FRAME_LEGACY)
+        return frame;
+
+    auto *p = (packet *)buffer;
+    memset(p, 0, sizeof(packet));
+    decode_frame(frame, *len, p);
+    *len = sizeof(packet);
+    return buffer;
+}
+
+void RetainCache::unlink(uint32_t topic) {
+    entry &e = entries[topic];
+    if (e.prev != NONE)
+        entries[e.prev].next = e.next;
+    else
+        head = e.next;
+    if (e.next != NONE)
+        entries[e.next].prev = e.prev;
+    else
+        tail = e.prev;
+    e.prev = e.next = NONE;
+}
+
+void RetainCache::push_front(uint32_t topic) {
+    entry &e = entries[topic];
+    e.prev = NONE;
+    e.next = head;
+    if (head != NONE)
+        entries[head].prev = topic;
+    head = topic;
+    if (tail == NONE)
+        tail = topic;
+}
+
+void RetainCache::evict(uint32_t topic) {
+    entry &e = entries[topic];
+    unlink(topic);
+    slab_free(e.frame, e.len);
+    bytes -= e.len;
+    cached--;
+    e.frame = nullptr;
+    e.len = 0;
+}
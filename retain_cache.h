@@ -0,0 +1,59 @@
+#ifndef _RETAIN_CACHE_H
+#define _RETAIN_CACHE_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Last value cache: the newest compact frame published on every
+// retained topic, indexed by the worker's topic ID. Frames are copied
+// into slab blocks of their own size, so a cached topic doesn't keep a
+// whole pooled message. Once they take more than limit bytes the topics
+// that were neither published nor read for the longest go first.
+class RetainCache {
+public:
+    explicit RetainCache(size_t limit);
+    RetainCache(const RetainCache &) = delete;
+    ~RetainCache();
+
+    // Replaces whatever topic had cached
+    void put(uint32_t topic, const char *frame, size_t len);
+
+    // The cached frame, nullptr if there's none. Counts as a use
+    const char *get(uint32_t topic, size_t *len);
+
+    // Bytes that go on the wire for the cached frame, unpacked into
+    // buffer (MAX_WIRE_LEN bytes) for legacy clients
+    const char *wire(uint32_t topic, int version, char *buffer, size_t *len);
+
+    // Every cached topic, most recently used first
+    template <typename F>
+    void each(F f) const {
+        for (uint32_t t = head; t != NONE; t = entries[t].next)
+            f(t);
+    }
+
+    size_t count() const { return cached; }
+    size_t size() const { return bytes; }
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    struct entry {
+        char *frame;
+        uint32_t len;
+
+        // neighbours on the LRU list, head is the newest
+        uint32_t prev, next;
+    };
+
+    std::vector<entry> entries;
+    uint32_t head, tail;
+    size_t limit, bytes, cached;
+
+    void unlink(uint32_t topic);
+    void push_front(uint32_t topic);
+    void evict(uint32_t topic);
+};
+
+#endif
@@ -1,495 +1,275 @@
+#include "broker.h"
+#include "event_loop.h"
 #include "helpers.h"
-#include <arpa/inet.h>
-#include <exception>
-#include <netinet/in.h>
-#include <poll.h>
-#include <queue>
 #include <cstdio>
 #include <cstdlib>
+#include <csignal>
 #include <cstring>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
 #include <unistd.h>
-#include <unordered_map>
-#include <utility>
-#include <vector>
 
 using namespace std;
 
-// Custom exceptions for my findClient method
-class ClientNotFound : public exception {
-    const char *what() const noexcept override {
-        return "Client Not Found\n";
-    }
-};
-
-class ClientSocketDisconnected : public exception {
-public:
-    int index;
-    const char *what() const noexcept override {
-        return "Client Socket Disconnected\n";
-    }
-
-    explicit ClientSocketDisconnected(int _index) {
-        index = _index;
-    }
-};
-
-// Client class to hold info
-// cli_addr and clilen aren't required but could be useful if this
-// was a real app that could require more stuff later
-class Client {
-public:
-    // File descriptor for the client
-    int fd;
-
-    // ID of client
-    string id;
-
-    // Client IP and length
-    struct sockaddr_in cli_addr{};
-    socklen_t clilen;
-
-    // A Map to keep track which Topics
-    // are subscribed with SF and which aren't
-    unordered_map<string, int> topics;
-
-    // findClient has 2 overloads for searching by fd or id
-    // returns the index where the client can be found or an exception
-    // ClientDisconnected containing the index where the client can be found
-    // ClientNotFound if the client doesn't exist with specified search param
-    static int findClient(vector<Client *> clients, int fd) {
-        for (int i = 0; i < clients.size(); i++) {
-            if (fd == clients[i]->fd) {
-                if (clients[i]->fd == CLIENT_DISCONNECTED) {
-                    throw ClientSocketDisconnected(i);
-                }
-                return i;
-            }
-        }
-        throw ClientNotFound();
-    }
-
-    static int findClient(vector<Client *> clients, const string& id) {
-        for (int i = 0; i < clients.size(); i++) {
-            if (id == clients[i]->id) {
-                if (clients[i]->fd == CLIENT_DISCONNECTED) {
-                    throw ClientSocketDisconnected(i);
-                }
-                return i;
-            }
-        }
-        throw ClientNotFound();
-    }
-
-    // Decouples the client from the list, doesn't free the client memory
-    static void removeClient(vector<Client *> &clients, Client *toRemove) {
-        for (int i = 0; i < clients.size(); i++) {
-            if (toRemove->id == clients[i]->id) {
-                clients.erase(clients.begin() + i);
-            }
-        }
-    }
-
-    // Simple Constructor
-    Client(int _fd, string _id, struct sockaddr_in _cli_addr, socklen_t _clilen) {
-        fd = _fd;
-        id = string(std::move(_id));
-        cli_addr = _cli_addr;
-        clilen = _clilen;
-    }
-};
+// Local admin socket, every connection gets a JSON snapshot of the
+// stats and is closed
+static int admin_listen(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    DIE(fd < 0, "socket");
+
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // Whatever an earlier run left behind is in the way
+    unlink(path);
+    DIE(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0, "ERROR: Couldn't bind admin socket.\n");
+    DIE(listen(fd, QUEUE_LEN) < 0, "ERROR: Couldn't listen.\n");
+    return fd;
+}
 
 int main(int argc, char *argv[]) {
     // Disable print buffering
     setvbuf(stdout, nullptr, _IONBF, BUFSIZ);
 
-    // file descriptors
-    int sockfd, udpfd, newsockfd, portno;
-
-    // ip addresses
-    struct sockaddr_in serv_addr{}, cli_addr{};
-    socklen_t clilen = sizeof(cli_addr);
+    // Sockets are all written with MSG_NOSIGNAL, this is for stdout. A
+    // broker whose log pipe went away keeps serving instead of dying on
+    // its next printf
+    signal(SIGPIPE, SIG_IGN);
 
     // buffer
     char buffer[BUFLEN];
 
-    // misc variables, i is index, n is number of byes read
-    // ret is used for error handling, run_server determines
-    // when the server needs to stop running
-    int i, ret, run_server = 1;
-    ssize_t n;
-
     // Check usage
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s server_port\n", argv[0]);
+        fprintf(stderr, "Usage: %s server_port [--threads N] [--out-limit BYTES]"
+                        " [--overflow drop|disconnect|spill] [--store DIR]"
+                        " [--fsync never|batch|always] [--admin PATH]"
+                        " [--io epoll|uring] [--zerocopy] [--flush-delay US]"
+                        " [--sf-quota MSGS,BYTES] [--sf-total MSGS,BYTES]"
+                        " [--sf-overflow drop-oldest|drop-newest|spill] [--spill-dir DIR]"
+                        " [--sf-ttl [TOPIC=]SECS]... [--retain PATTERN]..."
+                        " [--retain-limit BYTES] [--node NAME] [--peer IP:PORT]...\n",
+                argv[0]);
         return 0;
     }
 
-    // UDP listen fd
-    udpfd = socket(AF_INET, SOCK_DGRAM, 0);
-    DIE(udpfd < 0, "ERROR: Couldn't open UDP fd.\n");
-
-    // TCP listen fd
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    DIE(sockfd < 0, "ERROR: Couldn't open TCP listen fd.\n");
-
-    // Sets a socket bunch of options
-    set_socket_options(sockfd);
-
-    // Set fd to be non blocking.
-    int enable = 1;
-    ret = ioctl(sockfd, FIONBIO, &enable);
-    DIE(ret < 0, "ERROR: ioctl");
-
     // Server port
-    portno = atoi(argv[1]);
+    int portno = atoi(argv[1]);
     DIE(portno < 0, "ERROR: Bad port.\n");
 
-    // Fill out server address info
-    memset((char *)&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(portno);
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-
-    // Bind both TCP and UDP sockets
-    ret = bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr));
-    DIE(ret < 0, "ERROR: Couldn't bind.\n");
-
-    ret = bind(udpfd, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr));
-    DIE(ret < 0, "ERROR: Couldn't bind.\n");
-
-    // Listen on the TCP fd
-    ret = listen(sockfd, QUEUE_LEN);
-    DIE(ret < 0, "ERROR: Couldn't listen.\n");
-
-    // Vector of clients, I'm using this like a list (but faster)
-    // I admit that I don't particularly need constant time access,
-    // but it's faster than linked lists
-    vector<Client *> clients;
-
-    // Vector of file descriptors, I'm using poll() instead of select()
-    // therefore I'm using the required struct (pollfd)
-    // new_fd creates a new struct pollfd with the given params
-    vector<struct pollfd> fds;
-    fds.push_back(new_fd(sockfd, POLLIN));
-    fds.push_back(new_fd(udpfd, POLLIN));
-    fds.push_back(new_fd(fileno(stdin), POLLIN));
-
-    // Topic Map keeps a list of Clients subscribed to a certain topic
-    // Makes finding and sending the messages to the appropiate clients fast.
-    unordered_map<string, vector<Client *>> topic_map;
-
-    // Store and Forward map, keeps a queue of packets for the clients
-    // that subscribed with the store and forward option
-    unordered_map<Client *, queue<packet *>> sf_map;
-
-    while (run_server) {
-        // poll the file descriptors for which is active
-        ret = poll(&fds[0], fds.size(), 0);
-        DIE(ret < 0, "poll");
-
-        // check what happened to each one
-        for (i = 0; i < fds.size(); i++) {
-            // if no event, we can skip
-            if (fds[i].revents == 0) {
+    // One worker, 1MB of output queue per subscriber and slow
+    // subscribers spill into store and forward unless told otherwise
+    broker_options options{};
+    options.nworkers = 1;
+    options.out_limit = OUT_LIMIT;
+    options.overflow = OVERFLOW_SPILL;
+
+    // Store and forward stays in memory unless a store is given,
+    // which is synced once per event loop round by default
+    options.store_dir = nullptr;
+    options.fsync = FSYNC_BATCH;
+    options.io = LOOP_EPOLL;
+    options.zerocopy = 0;
+    options.flush_delay = 0;
+    const char *admin_path = nullptr;
+
+    // Store and forward keeps everything until it's read, unless
+    // quotas or a TTL say otherwise
+    options.client_quota = options.total_quota = sf_quota{0, 0};
+    options.sf_overflow = SF_DROP_OLDEST;
+    options.spill_dir = nullptr;
+    options.ttl = 0;
+
+    // Nothing is retained unless asked for
+    options.retain_limit = RETAIN_LIMIT;
+
+    // A node is named after where it runs unless told otherwise
+    bool bad_peer = false;
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    options.node = string(host) + ":" + argv[1];
+
+    for (int i = 2; i < argc; i++) {
+        // The only option without a value
+        if (!strcmp(argv[i], "--zerocopy")) {
+            options.zerocopy = 1;
+            continue;
+        }
+        if (i + 1 == argc)
+            break;
+
+        if (!strcmp(argv[i], "--threads")) {
+            options.nworkers = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--out-limit")) {
+            options.out_limit = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--overflow")) {
+            i++;
+            if (!strcmp(argv[i], "drop"))
+                options.overflow = OVERFLOW_DROP;
+            else if (!strcmp(argv[i], "disconnect"))
+                options.overflow = OVERFLOW_DISCONNECT;
+            else if (!strcmp(argv[i], "spill"))
+                options.overflow = OVERFLOW_SPILL;
+            else
+                options.overflow = -1;
+        } else if (!strcmp(argv[i], "--store")) {
+            options.store_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--fsync")) {
+            i++;
+            if (!strcmp(argv[i], "never"))
+                options.fsync = FSYNC_NEVER;
+            else if (!strcmp(argv[i], "batch"))
+                options.fsync = FSYNC_BATCH;
+            else if (!strcmp(argv[i], "always"))
+                options.fsync = FSYNC_ALWAYS;
+            else
+                options.fsync = -1;
+        } else if (!strcmp(argv[i], "--admin")) {
+            admin_path = argv[++i];
+        } else if (!strcmp(argv[i], "--flush-delay")) {
+            options.flush_delay = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--sf-quota") || !strcmp(argv[i], "--sf-total")) {
+            sf_quota &quota = !strcmp(argv[i], "--sf-quota") ? options.client_quota
+                                                             : options.total_quota;
+            char *end;
+            quota.messages = strtoull(argv[++i], &end, 10);
+            quota.bytes = *end == ',' ? strtoull(end + 1, nullptr, 10) : 0;
+        } else if (!strcmp(argv[i], "--sf-overflow")) {
+            i++;
+            if (!strcmp(argv[i], "drop-oldest"))
+                options.sf_overflow = SF_DROP_OLDEST;
+            else if (!strcmp(argv[i], "drop-newest"))
+                options.sf_overflow = SF_DROP_NEWEST;
+            else if (!strcmp(argv[i], "spill"))
+                options.sf_overflow = SF_SPILL;
+            else
+                options.sf_overflow = -1;
+        } else if (!strcmp(argv[i], "--spill-dir")) {
+            options.spill_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--sf-ttl")) {
+            // The last '=' splits, topics may hold one too
+            const char *arg = argv[++i];
+            const char *equals = strrchr(arg, '=');
+            uint64_t ttl = strtoull(equals ? equals + 1 : arg, nullptr, 10) * 1000000000ull;
+            if (equals)
+                options.ttls[string(arg, equals - arg)] = ttl;
+            else
+                options.ttl = ttl;
+        } else if (!strcmp(argv[i], "--retain")) {
+            options.retain.emplace_back(argv[++i]);
+        } else if (!strcmp(argv[i], "--retain-limit")) {
+            options.retain_limit = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--node")) {
+            options.node = argv[++i];
+        } else if (!strcmp(argv[i], "--peer")) {
+            string arg = argv[++i];
+            size_t colon = arg.rfind(':');
+            struct sockaddr_in peer{};
+            peer.sin_family = AF_INET;
+            if (colon == string::npos ||
+                !inet_aton(arg.substr(0, colon).c_str(), &peer.sin_addr) ||
+                atoi(arg.c_str() + colon + 1) <= 0) {
+                bad_peer = true;
                 continue;
             }
+            peer.sin_port = htons(atoi(arg.c_str() + colon + 1));
+            options.peers.push_back(peer);
+        } else if (!strcmp(argv[i], "--io")) {
+            i++;
+            if (!strcmp(argv[i], "epoll"))
+                options.io = LOOP_EPOLL;
+            else if (!strcmp(argv[i], "uring"))
+                options.io = LOOP_URING;
+            else
+                options.io = -1;
+        }
+    }
+    if (options.nworkers < 1 || options.nworkers > MAX_WORKERS) {
+        fprintf(stderr, "The number of threads must be between 1 and %d\n",
+                MAX_WORKERS);
+        return 0;
+    }
+    if (options.out_limit < MAX_FRAME_LEN || options.overflow < 0) {
+        fprintf(stderr, "Bad output queue settings.\n");
+        return 0;
+    }
+    if (options.fsync < 0) {
+        fprintf(stderr, "Bad fsync policy.\n");
+        return 0;
+    }
+    if (options.sf_overflow < 0 ||
+        (options.sf_overflow == SF_SPILL && (!options.spill_dir || options.store_dir))) {
+        fprintf(stderr, "Bad store and forward overflow policy, spill needs a"
+                        " --spill-dir and no --store.\n");
+        return 0;
+    }
+    if (options.io < 0) {
+        fprintf(stderr, "Bad io backend.\n");
+        return 0;
+    }
+    if (bad_peer || options.node.empty() || strchr(options.node.c_str(), ' ')) {
+        fprintf(stderr, "Bad federation settings, peers are IP:PORT and node"
+                        " names have no spaces.\n");
+        return 0;
+    }
 
-            // STDIN file descriptor active
-            if (fds[i].fd == fileno(stdin)) {
-                // Read from STDIN and remove trailing \r\n's if they exist
-                memset(buffer, 0, BUFLEN);
-                DIE(!fgets(buffer, BUFLEN - 1, stdin), "ERROR: fgets.\n");
-                buffer[strcspn(buffer, "\r\n")] = 0;
-
-                // The only command is exit
-                if (!strncmp(buffer, "exit", 4)) {
-                    run_server = 0;
-                    break;
-                }
-            }
-
-            // TCP listen active
-            else if (fds[i].fd == sockfd) {
-                // New client is connecting, accept his connection
-                clilen = sizeof(cli_addr);
-                newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-                DIE(newsockfd < 0, "accept");
-
-                // Enable socket options
-                set_socket_options(newsockfd);
-
-                // As per protocol, client must send his ID when connecting
-                memset(buffer, 0, BUFLEN);
-                n = recv_variable(newsockfd, buffer, sizeof(buffer));
-                DIE(n < 0, "recv");
-
-                // No need to parse the struct since it's just a byte array.
-                string id = string(buffer, n);
-
-                try {
-                    // If findClient doesn't throw an exception, the client
-                    // is already conncted.
-                    Client::findClient(clients, id);
-
-                    // Not getting an exception means client already connected
-                    printf("Client %s already connected.\n", id.c_str());
-
-                    // Generate a Server-TCP Client packet with data type REPLY
-                    packet reply;
-                    reply.data_t = PACKET_REPLY;
-                    strcpy(reply.payload, "ERRSAMEID");
-                    n = send_packet(newsockfd, (char *)&reply, sizeof(reply));
-                    DIE(n < 0, "error send");
-                    break;
-                } catch (ClientSocketDisconnected &ex) {
-                    // If the Client exists but is disconnected, we update his fd
-                    // And we check if he had any topic subscribed with SF
-                    clients[ex.index]->fd = newsockfd;
-
-                    try {
-                        // If this throws an exception it means
-                        // the client never subscribed with SF
-                        auto queue = sf_map.at(clients[ex.index]);
-
-                        // Regardless if there's an exception or not,
-                        // nothing will happen if there IS a bucket
-                        // with no packets since we check if the queue is empty
-                        while (!queue.empty()) {
-                            // Extract, send and free packets
-                            packet *p = queue.front();
-                            n = send_packet(newsockfd, (char *)p, sizeof(packet));
-                            DIE(n < 0, "error send");
-                            free(p);
-                            queue.pop();
-                        }
+    // Every worker runs its own event loop, this thread only
+    // has to wait for commands on stdin and the admin socket
+    Broker broker(portno, options);
+    broker.start();
+
+    // stdin is level triggered and unbuffered so fgets never keeps
+    // a line hidden from epoll
+    EventLoop loop;
+    setvbuf(stdin, nullptr, _IONBF, 0);
+    int ret = loop.add(fileno(stdin), EPOLLIN);
+    DIE(ret < 0 && errno != EPERM, "epoll_ctl");
+
+    int adminfd = -1;
+    if (admin_path) {
+        adminfd = admin_listen(admin_path);
+        DIE(loop.add(adminfd, EPOLLIN) < 0, "epoll_ctl");
+    }
 
-                        // Update the value of the SF Map with the queue
-                        sf_map[clients[ex.index]] = queue;
-                    } catch (exception &ex) {
-                        // client had no packets to be sent to him, simply continue
-                    }
-                    // No client with this ID ever existed, create new Client instance
-                } catch (ClientNotFound &ex) {
-                    // create new Client instance
-                    clients.push_back(new Client(newsockfd, id, cli_addr, clilen));
-                }
-                // If we made it here it means that either the Client wasn't found
-                // Or his file descriptor was updated accordingly
+    bool running = true;
+    while (running) {
+        int nready = loop.wait(-1);
 
-                // Add the new file descriptor to the list
-                fds.push_back(new_fd(newsockfd, POLLIN));
+        for (int i = 0; i < nready && running; i++) {
+            int fd = loop.events[i].data.fd;
 
-                // Print to stdout
-                printf("New client %s connected from %s:%u.\n",
-                       id.c_str(), inet_ntoa(cli_addr.sin_addr),
-                       ntohs(cli_addr.sin_port));
+            if (fd == adminfd) {
+                int client = accept(adminfd, nullptr, nullptr);
+                if (client < 0)
+                    continue;
+                string json = format_stats_json(broker.stats());
+                send_packet(client, (char *)json.data(), json.size());
+                close(client);
+                continue;
             }
 
-            // UDP fd active
-            else if (fds[i].fd == udpfd) {
-                // Receive UDP packet (UDP is packet oriented, so all is good)
-                memset(buffer, 0, BUFLEN);
-                clilen = sizeof(cli_addr);
-                n = recvfrom(udpfd, buffer, sizeof(buffer), 0,
-                             (struct sockaddr *)&cli_addr, &clilen);
-                DIE(n < 0, "recvfrom");
-
-                // Extract topic from the packet
-                auto *info = (packet *)malloc(sizeof(packet));
-                memcpy(info, buffer, n);
-
-                // Fill out information about who sent packet
-                info->cli_addr = cli_addr;
-
-                // Extract list of subscribers to this particular topic
-                vector<Client *> subscribers;
-                try {
-                    subscribers = topic_map.at(info->topic);
-                } catch (exception &ex) {
-                    break;
-                }
-
-                // Forward packet to all subscribers of the given topic
-                for (auto client : subscribers) {
-                    // If the client isn't disconnected
-                    if (client->fd != -1) {
-                        n = send_packet(client->fd, (char *)info, sizeof(packet));
-                        DIE(n < 0, "error send");
-                    }
-                    // if SF is enabled and client is disconnected store the packet
-                    if (client->topics[info->topic] == 1 && client->fd == -1) {
-                        // Get the queue of packets to be sent to this particular client
-                        // If it exists, if it doesn't this makes a new one regardless
-                        queue<packet *> to_send;
-                        try {
-                            to_send = sf_map.at(client);
-                        } catch (exception &ex) {
-                            // well, nothing really.
-                        }
-                        // Make a copy of the packet and add it to the queue
-                        auto *copy = new packet();
-                        memcpy(copy, info, sizeof(packet));
-
-                        // Add the packet to the queue and update the value of the map
-                        to_send.push(copy);
-                        sf_map[client] = to_send;
-                    }
-                }
-                // Free the packet, this is why we made a copy for the queued packets
-                free(info);
-
-            } else {
-                // We received data from one of our TCP Clients
-                // As per protocol receive a client_packet
-                // Containing the command
-                memset(buffer, 0, BUFLEN);
-                n = recv_variable(fds[i].fd, buffer, sizeof(buffer));
-                DIE(n < 0, "recv");
-
-                // Connection closed
-                if (n == 0) {
-                    // no error handling since there CANT be an error here
-                    // the client definitely exists
-                    int index = Client::findClient(clients, fds[i].fd);
-                    printf("Client %s disconnected.\n", clients[index]->id.c_str());
-
-                    // Remove the file descriptor from the list and close the fd
-                    fds.erase(fds.begin() + i);
-                    close(fds[i].fd);
-
-                    // set fd of client to DISCONNECTED
-                    // since clients are pointers, this will update clients in
-                    // topic_map and sf_map as well, reduces complexity by a bit
-                    clients[index]->fd = CLIENT_DISCONNECTED;
-                    break;
-                }
-
-                // Otherwise, we actually received data
-                // Start parsing the command
-                char *token = strtok(buffer, " ");
-                if (!strcmp(token, "subscribe")) {
-                    // Get the topic from the command
-                    token = strtok(nullptr, " ");
-                    string topic = string(token);
-
-                    // Extract the list of clients subscribed to this topic
-                    vector<Client *> subscribers;
-                    try {
-                        subscribers = topic_map.at(topic);
-                    } catch (exception &ex) {
-                        // do nothing
-                    }
-                    // No error handling, Client HAS to exist
-                    int index = Client::findClient(clients, fds[i].fd);
-
-                    // Check if the client is already subscribed
-                    int subscribed = 0;
-                    for (const auto& client_topics : clients[index]->topics) {
-                        if (client_topics.first == topic) {
-                            subscribed = 1;
-                            break;
-                        }
-                    }
-                    // usually we would also notify the client he is already
-                    // subscribed, but it's not part of the assignment
-                    if (subscribed)
-                        break;
-
-                    // Add the client to the list of subscribers on this topic
-                    subscribers.push_back(clients[index]);
-
-                    // Add the topic to the client's list of topics with the
-                    // specified option
-                    token = strtok(nullptr, " ");
-                    int option = atoi(token);
-                    DIE(option != 1 && option != 0, "ERROR: bad option");
-                    clients[index]->topics.insert(make_pair(topic, option));
-
-                    // Update the bucket with the list of subscribers
-                    topic_map[string(topic)] = subscribers;
-
-                    // Generate new Server->Client Reply, notifying that the operation
-                    // was successful then send the packet
-                    packet reply;
-                    reply.data_t = PACKET_REPLY;
-                    strcpy(reply.payload, "Subscribed to topic.\n");
-                    n = send_packet(clients[index]->fd, (char *)&reply, sizeof(reply));
-                    DIE(n < 0, "error send");
-                }
-
-                // Unsubscribe command
-                if (!strcmp(token, "unsubscribe")) {
-                    // Get the topic from the command
-                    token = strtok(nullptr, " ");
-
-                    // Extract the list of clients subscribed to this topic
-                    vector<Client *> subscribers;
-                    try {
-                        subscribers = topic_map.at(string(token));
-                    } catch (exception &ex) {
-                        // Normally a stderr print that topic doesn't exist
-                        break;
-                    }
-
-                    // Get the client from the list of clients,
-                    // No error handling, this has to exist
-                    int index = Client::findClient(clients, fds[i].fd);
-
-                    // Check if the client is already subscribed
-                    int subscribed = 0;
-                    for (const auto& topic : clients[index]->topics) {
-                        if (topic.first == string(token)) {
-                            subscribed = 1;
-                            break;
-                        }
-                    }
-                    // If not subscribed, nothing to do here
-                    if (!subscribed)
-                        break;
-
-                    // Remove the client from the list of subscribers on this topic
-                    Client::removeClient(subscribers, clients[index]);
-
-                    // Remove this topic from the client's list of topics
-                    clients[index]->topics.erase(string(token));
-
-                    // Update the bucket with the new list of subscribers
-                    topic_map[string(token)] = subscribers;
-
-                    // Notify client with a REPLY that the operation
-                    // was successful and is unsubscribed
-                    packet reply;
-                    reply.data_t = PACKET_REPLY;
-                    strcpy(reply.payload, "Unsubscribed from topic.\n");
-                    n = send_packet(clients[index]->fd, (char *)&reply, sizeof(reply));
-                    DIE(n < 0, "error send");
-                }
+            // Read from STDIN and remove trailing \r\n's if they exist
+            if (!fgets(buffer, BUFLEN - 1, stdin)) {
+                running = false;
+                break;
+            }
+            buffer[strcspn(buffer, "\r\n")] = 0;
+
+            if (!strncmp(buffer, "exit", 4)) {
+                running = false;
+            } else if (!strcmp(buffer, "stats")) {
+                auto stats = broker.stats();
+                string text = format_stats(stats);
+                fwrite(text.data(), 1, text.size(), stdout);
             }
         }
     }
 
-    // close remaining fds
-    for (auto pollfd : fds) {
-        shutdown(pollfd.fd, SHUT_RDWR);
-        close(pollfd.fd);
-    }
-
-    // free any packets that were saved but didn't get sent
-    // (client sub to SF, disconnected and never reconnected)
-    for (const auto& entry : sf_map) {
-        auto queue = entry.second;
-        while (!queue.empty()) {
-            packet *p = queue.front();
-            free(p);
-            queue.pop();
-        }
-    }
-
-    // free memory allocated to clients
-    for (auto client : clients) {
-        free(client);
+    if (adminfd >= 0) {
+        close(adminfd);
+        unlink(admin_path);
     }
+    broker.stop();
     return 0;
-}
+}
\ No newline at end of file
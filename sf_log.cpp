@@ -0,0 +1,375 @@
+#include "sf_log.h"
+#include "metrics.h"
+#include <cstdint>
+#include <utility>
+
+TopicLog::TopicLog(std::string _topic, SegmentLog *_disk, LogSpace *_space, uint64_t _ttl) {
+    topic = std::move(_topic);
+    disk = _disk;
+    spilled = nullptr;
+    space = _space;
+    ttl = _ttl;
+    expiring = false;
+    appended = 0;
+    live = 0;
+    first = disk ? disk->first() : 0;
+    next = disk ? disk->next() : 0;
+
+    // What the store kept from the last run counts too
+    account({0, 0, 0});
+}
+
+TopicLog::~TopicLog() {
+    held now = holding();
+    space->messages -= now.messages;
+    space->bytes -= now.bytes;
+    if (now.order)
+        space->fronts.erase({now.order, this});
+
+    for (auto &entry : entries)
+        message_put(entry.m);
+    if (spilled) {
+        spilled->remove();
+        delete spilled;
+    }
+    delete disk;
+}
+
+void TopicLog::append(message *m, uint64_t order) {
+    if (held_first() == next)
+        space->fronts.insert({order, this});
+    space->messages++;
+    space->bytes += m->frame_len;
+
+    uint64_t time = now_ns();
+    if (disk) {
+        disk->append(m->frame, m->frame_len, order, time);
+    } else {
+        message_get(m);
+        entries.push_back({order, m, appended, time});
+        appended += m->frame_len;
+    }
+    next++;
+}
+
+uint64_t TopicLog::order_at(uint64_t pos) const {
+    if (const SegmentLog *segments = segments_at(pos))
+        return segments->entry(pos).order;
+    return entries[pos - (next - entries.size())].order;
+}
+
+uint64_t TopicLog::bytes_from(uint64_t pos) const {
+    if (pos >= next)
+        return 0;
+    if (disk)
+        return disk->bytes_from(pos);
+
+    uint64_t in_memory = next - entries.size();
+    if (pos >= in_memory)
+        return appended - entries[pos - in_memory].offset;
+    uint64_t bytes = entries.empty() ? 0 : appended - entries.front().offset;
+    return bytes + (spilled ? spilled->bytes_from(pos) : 0);
+}
+
+const char *TopicLog::wire_at(uint64_t pos, int version, char *buffer,
+                              size_t *len) const {
+    const SegmentLog *segments = segments_at(pos);
+    const char *frame;
+    if (segments) {
+        frame = segments->frame(pos);
+        *len = segments->entry(pos).len;
+    } else {
+        frame = message_wire(message_at(pos), version, len);
+    }
+
+    // Version 3 clients get the order as the sequence number
+    if (version >= FRAME_V3) {
+        *len = sequence_frame(buffer, frame, *len, order_at(pos));
+        return buffer;
+    }
+
+    // Segments keep compact frames, legacy clients get them unpacked
+    if (!segments || version != FRAME_LEGACY)
+        return frame;
+
+    auto *p = (packet *)buffer;
+    memset(p, 0, sizeof(packet));
+    decode_frame(frame, *len, p);
+    *len = sizeof(packet);
+    return buffer;
+}
+
+void TopicLog::add_cursor(uint64_t pos) {
+    cursors[pos]++;
+    live++;
+}
+
+void TopicLog::move_cursor(uint64_t from, uint64_t to) {
+    cursors[to]++;
+    unpin(from);
+}
+
+void TopicLog::drop_cursor(uint64_t pos, uint64_t end) {
+    if (end == UINT64_MAX) {
+        live--;
+    } else {
+        auto stop = ends.find(end);
+        if (--stop->second == 0)
+            ends.erase(stop);
+    }
+    unpin(pos);
+    cut();
+}
+
+void TopicLog::stop_cursor(uint64_t from, uint64_t to) {
+    if (from == UINT64_MAX) {
+        live--;
+    } else {
+        auto stop = ends.find(from);
+        if (--stop->second == 0)
+            ends.erase(stop);
+    }
+    ends[to]++;
+    cut();
+}
+
+void TopicLog::unpin(uint64_t pos) {
+    auto entry = cursors.find(pos);
+    if (--entry->second == 0) {
+        cursors.erase(entry);
+        trim();
+    }
+}
+
+uint64_t TopicLog::drop_oldest() {
+    uint64_t from = held_first(), before = first;
+    if (from == next)
+        return 0;
+
+    if (disk) {
+        Segment *segment = disk->segment_of(from);
+        release(segment->first + segment->count);
+    } else {
+        release(from + 1);
+    }
+    return first - before;
+}
+
+bool TopicLog::spill_oldest(Store *to) {
+    if (disk || entries.empty())
+        return false;
+
+    held before = holding();
+    const log_entry &entry = entries.front();
+    if (!spilled)
+        spilled = to->fresh_log(topic, next - entries.size());
+    spilled->append(entry.m->frame, entry.m->frame_len, entry.order, entry.time);
+    message_put(entry.m);
+    entries.pop_front();
+    account(before);
+    return true;
+}
+
+uint64_t TopicLog::expires() const {
+    if (!ttl || first == next)
+        return 0;
+    if (const SegmentLog *segments = segments_at(first))
+        return segments->segment_of(first)->newest + ttl;
+    return entries.front().time + ttl;
+}
+
+uint64_t TopicLog::expire(uint64_t now) {
+    uint64_t before = first;
+    while (first < next && expires() <= now) {
+        if (const SegmentLog *segments = segments_at(first)) {
+            Segment *segment = segments->segment_of(first);
+            release(segment->first + segment->count);
+            continue;
+        }
+
+        // Entries in memory were appended in time order
+        uint64_t in_memory = next - entries.size(), pos = first;
+        while (pos < next && entries[pos - in_memory].time + ttl <= now)
+            pos++;
+        release(pos);
+        break;
+    }
+    return first - before;
+}
+
+void TopicLog::trim() {
+    uint64_t oldest = cursors.empty() ? next : cursors.begin()->first;
+    release(oldest);
+}
+
+void TopicLog::cut() {
+    // Positions in the store carry on across restarts, it keeps them
+    if (live || disk || ends.empty())
+        return;
+
+    uint64_t keep = std::max(ends.rbegin()->first, first);
+    held before = holding();
+    while (next > keep && !entries.empty()) {
+        appended = entries.back().offset;
+        message_put(entries.back().m);
+        entries.pop_back();
+        next--;
+    }
+    account(before);
+}
+
+void TopicLog::release(uint64_t pos) {
+    pos = std::min(pos, next);
+    if (pos <= first)
+        return;
+
+    held before = holding();
+    first = pos;
+    if (disk) {
+        disk->trim(pos);
+    } else {
+        if (spilled && pos >= spilled->next()) {
+            spilled->remove();
+            delete spilled;
+            spilled = nullptr;
+        } else if (spilled) {
+            spilled->trim(pos);
+        }
+        while (next - entries.size() < pos) {
+            message_put(entries.front().m);
+            entries.pop_front();
+        }
+    }
+    account(before);
+}
+
+TopicLog::held TopicLog::holding() const {
+    uint64_t from = held_first();
+    if (from == next)
+        return {0, 0, 0};
+    if (disk)
+        return {next - from, disk->bytes_from(from), disk->entry(from).order};
+    return {entries.size(), appended - entries.front().offset, entries.front().order};
+}
+
+void TopicLog::account(const held &before) {
+    held now = holding();
+    space->messages += now.messages - before.messages;
+    space->bytes += now.bytes - before.bytes;
+    if (now.order != before.order) {
+        if (before.order)
+            space->fronts.erase({before.order, this});
+        if (now.order)
+            space->fronts.insert({now.order, this});
+    }
+}
+
+void Backlog::add(TopicLog *log, uint64_t pos) {
+    log->add_cursor(pos);
+    cursors.push_back({log, pos, UINT64_MAX});
+}
+
+void Backlog::remove(TopicLog *log) {
+    for (size_t i = 0; i < cursors.size(); i++) {
+        if (cursors[i].log == log) {
+            log->drop_cursor(cursors[i].pos, cursors[i].end);
+            cursors.erase(cursors.begin() + i);
+            return;
+        }
+    }
+}
+
+void Backlog::clear() {
+    for (auto &cursor : cursors)
+        cursor.log->drop_cursor(cursor.pos, cursor.end);
+    cursors.clear();
+}
+
+log_cursor *Backlog::oldest() {
+    log_cursor *best = nullptr;
+    for (auto &cursor : cursors) {
+        // Whatever the quotas or expiry dropped meanwhile is lost
+        if (cursor.pos < cursor.log->first)
+            advance(&cursor, cursor.log->first - cursor.pos);
+        if (cursor.pos >= stop(cursor))
+            continue;
+        if (!best || cursor.log->order_at(cursor.pos) < best->log->order_at(best->pos))
+            best = &cursor;
+    }
+    if (!best)
+        return nullptr;
+
+    uint64_t order = best->log->order_at(best->pos);
+    for (auto &cursor : cursors) {
+        if (&cursor != best && cursor.pos < stop(cursor) &&
+            cursor.log->order_at(cursor.pos) == order)
+            advance(&cursor);
+    }
+    return best;
+}
+
+void Backlog::advance(log_cursor *cursor, uint64_t count) {
+    cursor->log->move_cursor(cursor->pos, cursor->pos + count);
+    cursor->pos += count;
+}
+
+bool Backlog::skip(uint64_t order) {
+    bool moved = false;
+    for (auto &cursor : cursors) {
+        // Orders only grow along a log
+        uint64_t low = std::max(cursor.pos, cursor.log->first), high = stop(cursor);
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (cursor.log->order_at(middle) <= order)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low > cursor.pos) {
+            advance(&cursor, low - cursor.pos);
+            moved = true;
+        }
+    }
+    return moved;
+}
+
+void Backlog::held(uint64_t *messages, uint64_t *bytes) const {
+    *messages = *bytes = 0;
+    for (const auto &cursor : cursors) {
+        uint64_t from = std::max(cursor.pos, cursor.log->held_first());
+        uint64_t to = stop(cursor);
+        if (from >= to)
+            continue;
+        *messages += to - from;
+        *bytes += cursor.log->bytes_from(from) - cursor.log->bytes_from(to);
+    }
+}
+
+void Backlog::freeze() {
+    for (auto &cursor : cursors) {
+        if (cursor.end == UINT64_MAX) {
+            cursor.end = stop(cursor);
+            cursor.log->stop_cursor(UINT64_MAX, cursor.end);
+        }
+    }
+}
+
+bool Backlog::drop_newest() {
+    log_cursor *newest = nullptr;
+    uint64_t order = 0;
+    for (auto &cursor : cursors) {
+        uint64_t to = stop(cursor);
+        if (std::max(cursor.pos, cursor.log->held_first()) >= to)
+            continue;
+        if (!newest || cursor.log->order_at(to - 1) > order) {
+            newest = &cursor;
+            order = cursor.log->order_at(to - 1);
+        }
+    }
+    if (!newest)
+        return false;
+    uint64_t end = stop(*newest) - 1;
+    newest->log->stop_cursor(newest->end, end);
+    newest->end = end;
+    return true;
+}
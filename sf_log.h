@@ -0,0 +1,211 @@
+#ifndef _SF_LOG_H
+#define _SF_LOG_H 1
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "message.h"
+#include "slab.h"
+#include "sf_store.h"
+
+// One packet in a topic log, order is the worker wide publish
+// order so backlogs spanning several topics replay in order.
+// offset is how many bytes were appended to the log before it and
+// time the now_ns() it was appended at
+struct log_entry {
+    uint64_t order;
+    message *m;
+    uint64_t offset;
+    uint64_t time;
+};
+
+class TopicLog;
+
+// What the topic logs of a worker hold together, the quotas are
+// checked against it. Entries spilled to the disk don't count, the
+// ones in the store do. fronts has the order of every log's oldest
+// held entry, so the oldest one of all is the first
+struct LogSpace {
+    uint64_t messages, bytes;
+    std::set<std::pair<uint64_t, TopicLog *>, std::less<std::pair<uint64_t, TopicLog *>>,
+             SlabAllocator<std::pair<uint64_t, TopicLog *>>> fronts;
+
+    TopicLog *oldest() const { return fronts.empty() ? nullptr : fronts.begin()->second; }
+};
+
+// Append-only log of the messages published on a topic while some
+// client still has to catch up on it. Entries hold a reference to the
+// shared message instead of a copy, and are released as soon as every
+// cursor has moved past them.
+// With a persistent store the entries are compact frames in the
+// topic's segment files instead, and positions carry on across restarts.
+// Without one the oldest entries can be spilled to segment files when
+// memory runs short, the log then reads them back from there.
+// Quotas and expiry may drop entries cursors still point at, a cursor
+// behind first lost them and carries on from first.
+class TopicLog {
+public:
+    std::string topic;
+
+    // position of the oldest entry and of the next append
+    uint64_t first, next;
+    std::deque<log_entry, SlabAllocator<log_entry>> entries;
+
+    // nullptr unless the broker runs with a store
+    SegmentLog *disk;
+
+    // The entries before the ones in memory, nullptr unless some
+    // were spilled
+    SegmentLog *spilled;
+
+    // How long entries are kept in ns, 0 for as long as somebody
+    // needs them. Set while the worker has the log on its expiry heap
+    uint64_t ttl;
+    bool expiring;
+
+    TopicLog(std::string topic, SegmentLog *disk, LogSpace *space, uint64_t ttl);
+    TopicLog(const TopicLog &) = delete;
+    ~TopicLog();
+
+    // Only logs anything while somebody reads what comes next, cursors
+    // that stop somewhere (SF_DROP_NEWEST) don't count
+    bool wanted() const { return live > 0; }
+    void append(message *m, uint64_t order);
+    uint64_t order_at(uint64_t pos) const;
+
+    // Order of the newest entry, 0 if the log is empty
+    uint64_t last_order() const { return next > first ? order_at(next - 1) : 0; }
+
+    // Position of the oldest entry that counts against the quotas,
+    // anything before it is spilled
+    uint64_t held_first() const { return disk ? first : next - entries.size(); }
+
+    // Frame bytes of the entries from pos on
+    uint64_t bytes_from(uint64_t pos) const;
+
+    // Segment files the entry at pos is in, nullptr if it's in memory
+    const SegmentLog *segments_at(uint64_t pos) const {
+        return disk ? disk : pos < next - entries.size() ? spilled : nullptr;
+    }
+
+    // Bytes that go on the wire for the entry at pos, encoded
+    // into buffer (MAX_WIRE_LEN bytes) when they have to be
+    const char *wire_at(uint64_t pos, int version, char *buffer, size_t *len) const;
+
+    // The shared message at pos, nullptr if it only lives on the disk
+    message *message_at(uint64_t pos) const {
+        return segments_at(pos) ? nullptr : entries[pos - (next - entries.size())].m;
+    }
+
+    // end is where the cursor stops, UINT64_MAX if it doesn't
+    void add_cursor(uint64_t pos);
+    void move_cursor(uint64_t from, uint64_t to);
+    void drop_cursor(uint64_t pos, uint64_t end = UINT64_MAX);
+
+    // The cursor that stopped at from (UINT64_MAX if it didn't)
+    // stops at to from now on
+    void stop_cursor(uint64_t from, uint64_t to);
+
+    // Drops the oldest held entries whatever the cursors say, one entry
+    // from memory or a whole segment from the store. Returns how many
+    // went, 0 if there's nothing to drop
+    uint64_t drop_oldest();
+
+    // Moves the oldest entry in memory to a segment file in to,
+    // false if there's none
+    bool spill_oldest(Store *to);
+
+    // When the oldest entry runs out of time (0 never), and drops
+    // every entry that did by now, returning how many. Entries in
+    // segment files go a whole segment at a time
+    uint64_t expires() const;
+    uint64_t expire(uint64_t now);
+
+private:
+    LogSpace *space;
+
+    // Bytes ever appended, the offset of the next entry
+    uint64_t appended;
+
+    // how many cursors sit at each position, the oldest one is first
+    std::map<uint64_t, int> cursors;
+
+    // how many cursors read whatever gets appended, and how many of
+    // the others stop at each position
+    int live;
+    std::map<uint64_t, int> ends;
+
+    void unpin(uint64_t pos);
+
+    // Releases everything before the oldest cursor
+    void trim();
+
+    // Without a live cursor nobody reads past the last end, the
+    // entries in memory after it are released newest first
+    void cut();
+
+    // Releases everything before pos, cursors or not
+    void release(uint64_t pos);
+
+    // What the log holds against the quotas, keeps space up to date
+    // with the change since before
+    struct held {
+        uint64_t messages, bytes, order;
+    };
+    held holding() const;
+    void account(const held &before);
+};
+
+// end is where a client that hit its quota with SF_DROP_NEWEST stops
+// reading, UINT64_MAX otherwise
+struct log_cursor {
+    TopicLog *log;
+    uint64_t pos;
+    uint64_t end;
+};
+
+// Where a client is in every topic log it has to catch up on
+class Backlog {
+public:
+    std::vector<log_cursor> cursors;
+
+    void add(TopicLog *log, uint64_t pos);
+    void remove(TopicLog *log);
+    void clear();
+    bool empty() const { return cursors.empty(); }
+
+    // Cursor pointing at the oldest entry still to be sent,
+    // nullptr once every cursor caught up with its log.
+    // A message that made it into several of the logs is only handed
+    // out once, the other cursors skip it.
+    log_cursor *oldest();
+    void advance(log_cursor *cursor, uint64_t count = 1);
+
+    // Moves every cursor past the entries published up to order,
+    // false if none of them moved
+    bool skip(uint64_t order);
+
+    // Where the cursor stops reading
+    static uint64_t stop(const log_cursor &cursor) {
+        return std::min(cursor.end, cursor.log->next);
+    }
+
+    // Entries still to be sent and their bytes, counting only the ones
+    // held against the quotas
+    void held(uint64_t *messages, uint64_t *bytes) const;
+
+    // Stops every cursor where its log ends now, or leaves out the
+    // newest entry still to be sent. False if there's none
+    void freeze();
+    bool drop_newest();
+
+    // Drops the cursors without moving the logs, their places are
+    // kept by the store for the next run
+    void forget() { cursors.clear(); }
+};
+
+#endif
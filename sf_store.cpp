@@ -0,0 +1,440 @@
+#include "sf_store.h"
+#include "helpers.h"
+#include "metrics.h"
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <utility>
+
+using namespace std;
+
+// Maps the whole file at path, growing it to size first
+static void *map_file(const string &path, size_t size, int *fd) {
+    *fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    DIE(*fd < 0, "open segment");
+
+    struct stat st{};
+    DIE(fstat(*fd, &st) < 0, "fstat segment");
+    if ((size_t)st.st_size < size)
+        DIE(ftruncate(*fd, size) < 0, "ftruncate segment");
+
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    DIE(addr == MAP_FAILED, "mmap segment");
+    return addr;
+}
+
+// msync wants page aligned addresses
+static void sync_range(char *base, size_t from, size_t to) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    if (from >= to)
+        return;
+    from -= from % page;
+    DIE(msync(base + from, to - from, MS_SYNC) < 0, "msync");
+}
+
+// Topics can hold any character, so their directories are named in hex
+static string hex(const string &topic) {
+    static const char digits[] = "0123456789abcdef";
+    string name;
+    for (unsigned char c : topic) {
+        name += digits[c >> 4];
+        name += digits[c & 15];
+    }
+    return name;
+}
+
+static void make_dir(const string &path) {
+    DIE(mkdir(path.c_str(), 0755) < 0 && errno != EEXIST, "mkdir");
+}
+
+Segment::Segment(const string &dir, uint64_t _first) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%020llu", (unsigned long long)_first);
+    path = dir + name;
+    first = _first;
+
+    int index_fd;
+    data = (char *)map_file(path + ".log", SEGMENT_SIZE, &fd);
+    index = (segment_entry *)map_file(path + ".idx",
+                                      SEGMENT_ENTRIES * sizeof(segment_entry),
+                                      &index_fd);
+    close(index_fd);
+
+    // The unused part of the index is zeroes, a crash can leave an
+    // entry behind whose frame never made it, so every frame is checked
+    count = used = 0;
+    while (count < SEGMENT_ENTRIES) {
+        const segment_entry &entry = index[count];
+        if (!entry.len || entry.offset != used || entry.len > SEGMENT_SIZE - used ||
+            entry.len < sizeof(frame_header))
+            break;
+
+        auto *header = (const frame_header *)(data + entry.offset);
+        if (sizeof(header->len) + ntohs(header->len) != entry.len)
+            break;
+
+        used += entry.len;
+        count++;
+    }
+
+    // Whatever is past the last good entry gets overwritten
+    if (count < SEGMENT_ENTRIES)
+        memset(&index[count], 0, (SEGMENT_ENTRIES - count) * sizeof(segment_entry));
+    synced_count = count;
+    synced_used = used;
+    newest = now_ns();
+}
+
+Segment::~Segment() {
+    munmap(data, SEGMENT_SIZE);
+    munmap(index, SEGMENT_ENTRIES * sizeof(segment_entry));
+    close(fd);
+}
+
+bool Segment::fits(size_t len) const {
+    return count < SEGMENT_ENTRIES && len <= SEGMENT_SIZE - used;
+}
+
+void Segment::append(const char *frame, size_t len, uint64_t order, uint64_t time) {
+    memcpy(data + used, frame, len);
+    index[count] = {order, used, (uint32_t)len};
+    used += len;
+    count++;
+    newest = time;
+}
+
+void Segment::sync() {
+    sync_range(data, synced_used, used);
+    sync_range((char *)index, synced_count * sizeof(segment_entry),
+               count * sizeof(segment_entry));
+    synced_count = count;
+    synced_used = used;
+}
+
+void Segment::remove() {
+    unlink((path + ".log").c_str());
+    unlink((path + ".idx").c_str());
+}
+
+SegmentLog::SegmentLog(Store *_store, string _dir, uint64_t start) {
+    store = _store;
+    dir = std::move(_dir);
+    unsynced = false;
+
+    // Segments are named after their first position
+    vector<uint64_t> found;
+    DIR *d = opendir(dir.c_str());
+    DIE(!d, "opendir");
+    while (struct dirent *file = readdir(d)) {
+        const char *dot = strrchr(file->d_name, '.');
+        if (dot && !strcmp(dot, ".idx"))
+            found.push_back(strtoull(file->d_name, nullptr, 10));
+    }
+    closedir(d);
+    sort(found.begin(), found.end());
+
+    for (uint64_t pos : found)
+        segments.push_back(new Segment(dir, pos));
+    if (segments.empty())
+        segments.push_back(new Segment(dir, start));
+}
+
+SegmentLog::~SegmentLog() {
+    for (auto segment : segments)
+        delete segment;
+}
+
+uint64_t SegmentLog::first() const {
+    return segments.front()->first;
+}
+
+uint64_t SegmentLog::next() const {
+    return segments.back()->first + segments.back()->count;
+}
+
+uint64_t SegmentLog::last_order() const {
+    for (auto segment = segments.rbegin(); segment != segments.rend(); segment++) {
+        if ((*segment)->count)
+            return (*segment)->index[(*segment)->count - 1].order;
+    }
+    return 0;
+}
+
+void SegmentLog::append(const char *frame, size_t len, uint64_t order, uint64_t time) {
+    if (!segments.back()->fits(len))
+        segments.push_back(new Segment(dir, next()));
+    segments.back()->append(frame, len, order, time);
+
+    if (store->fsync == FSYNC_ALWAYS)
+        segments.back()->sync();
+    else if (store->fsync == FSYNC_BATCH)
+        store->unsynced(this);
+}
+
+Segment *SegmentLog::segment_of(uint64_t pos) const {
+    // The last segment starting at or before pos
+    auto after = upper_bound(segments.begin(), segments.end(), pos,
+                             [](uint64_t p, const Segment *s) { return p < s->first; });
+    return *(after - 1);
+}
+
+const segment_entry &SegmentLog::entry(uint64_t pos) const {
+    Segment *segment = segment_of(pos);
+    return segment->index[pos - segment->first];
+}
+
+const char *SegmentLog::frame(uint64_t pos) const {
+    Segment *segment = segment_of(pos);
+    return segment->data + segment->index[pos - segment->first].offset;
+}
+
+uint64_t SegmentLog::bytes_from(uint64_t pos) const {
+    if (pos >= next())
+        return 0;
+
+    // The rest of pos' segment and every segment after it
+    auto segment = upper_bound(segments.begin(), segments.end(), pos,
+                               [](uint64_t p, const Segment *s) { return p < s->first; }) - 1;
+    uint64_t bytes = (*segment)->used - (*segment)->index[pos - (*segment)->first].offset;
+    while (++segment != segments.end())
+        bytes += (*segment)->used;
+    return bytes;
+}
+
+void SegmentLog::trim(uint64_t oldest) {
+    while (segments.size() > 1 &&
+           segments.front()->first + segments.front()->count <= oldest) {
+        segments.front()->remove();
+        delete segments.front();
+        segments.pop_front();
+    }
+}
+
+void SegmentLog::sync() {
+    for (auto segment : segments)
+        segment->sync();
+    unsynced = false;
+}
+
+void SegmentLog::remove() {
+    for (auto segment : segments)
+        segment->remove();
+}
+
+Store::Store(const string &root, int index, int _fsync) {
+    fsync = _fsync;
+    journal_unsynced = false;
+
+    make_dir(root);
+    dir = root + "/worker-" + to_string(index);
+    make_dir(dir);
+
+    journal = open((dir + "/journal").c_str(),
+                   O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    DIE(journal < 0, "open journal");
+}
+
+Store::~Store() {
+    if (journal_unsynced)
+        fdatasync(journal);
+    close(journal);
+}
+
+SegmentLog *Store::open_log(const string &topic) {
+    string path = dir + "/" + hex(topic);
+    make_dir(path);
+    return new SegmentLog(this, path);
+}
+
+bool Store::has_log(const string &topic) const {
+    struct stat st{};
+    return stat((dir + "/" + hex(topic)).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+SegmentLog *Store::fresh_log(const string &topic, uint64_t first) {
+    string path = dir + "/" + hex(topic);
+    make_dir(path);
+
+    DIR *d = opendir(path.c_str());
+    DIE(!d, "opendir");
+    while (struct dirent *file = readdir(d)) {
+        if (file->d_name[0] != '.')
+            unlink((path + "/" + file->d_name).c_str());
+    }
+    closedir(d);
+    return new SegmentLog(this, path, first);
+}
+
+void Store::record(const char *line, size_t len) {
+    DIE(write(journal, line, len) != (ssize_t)len, "write journal");
+
+    if (fsync == FSYNC_ALWAYS)
+        DIE(fdatasync(journal) < 0, "fdatasync");
+    else if (fsync == FSYNC_BATCH)
+        journal_unsynced = true;
+}
+
+// Journal lines, IDs and topics never hold spaces since the
+// commands that bring them in are split on spaces:
+//   S id topic sf   subscribed
+//   U id topic      unsubscribed
+//   A id topic pos  went away with a cursor at pos, or a version 3
+//                   client acknowledged everything before it
+//   B id            came back and caught up
+void Store::subscribed(const string &id, const string &topic, int sf, const string &filter) {
+    string line = "S " + id + " " + topic + " " + to_string(sf);
+    if (!filter.empty())
+        line += " " + filter;
+    line += "\n";
+    record(line.c_str(), line.size());
+}
+
+void Store::unsubscribed(const string &id, const string &topic) {
+    string line = "U " + id + " " + topic + "\n";
+    record(line.c_str(), line.size());
+}
+
+void Store::away(const string &id, const string &topic, uint64_t pos) {
+    string line = "A " + id + " " + topic + " " + to_string(pos) + "\n";
+    record(line.c_str(), line.size());
+}
+
+void Store::back(const string &id) {
+    string line = "B " + id + "\n";
+    record(line.c_str(), line.size());
+}
+
+vector<stored_client> Store::recover() {
+    // Read the whole journal, it only ever holds one line per change
+    // since the last restart
+    string text;
+    char buffer[BUFLEN];
+    ssize_t n;
+    DIE(lseek(journal, 0, SEEK_SET) < 0, "lseek journal");
+    while ((n = read(journal, buffer, sizeof(buffer))) > 0)
+        text.append(buffer, n);
+    DIE(n < 0, "read journal");
+
+    vector<stored_client> clients;
+    unordered_map<string, size_t> found;
+
+    size_t start = 0, end;
+    while ((end = text.find('\n', start)) != string::npos) {
+        string line = text.substr(start, end - start);
+        start = end + 1;
+
+        char *save;
+        char *op = strtok_r(&line[0], " ", &save);
+        char *id = strtok_r(nullptr, " ", &save);
+        char *topic = strtok_r(nullptr, " ", &save);
+        char *arg = strtok_r(nullptr, " ", &save);
+        char *filter = strtok_r(nullptr, " ", &save);
+        if (!op || !id)
+            continue;
+
+        auto entry = found.find(id);
+        if (entry == found.end()) {
+            entry = found.emplace(id, clients.size()).first;
+            clients.push_back({id, {}, {}, {}});
+        }
+        stored_client &client = clients[entry->second];
+
+        if (!strcmp(op, "S") && topic && arg) {
+            client.topics[topic] = atoi(arg);
+            if (filter)
+                client.filters[topic] = filter;
+            else
+                client.filters.erase(topic);
+        } else if (!strcmp(op, "U") && topic) {
+            client.topics.erase(topic);
+            client.filters.erase(topic);
+        } else if (!strcmp(op, "A") && topic && arg) {
+            // Acknowledgements move a cursor that's already there
+            uint64_t pos = strtoull(arg, nullptr, 10);
+            auto cursor = find_if(client.cursors.begin(), client.cursors.end(),
+                                  [&](const pair<string, uint64_t> &c) { return c.first == topic; });
+            if (cursor != client.cursors.end())
+                cursor->second = pos;
+            else
+                client.cursors.emplace_back(topic, pos);
+        } else if (!strcmp(op, "B")) {
+            client.cursors.clear();
+        }
+    }
+
+    // Start over with one line per subscription and cursor, a torn
+    // last line from a crash goes away with the rest
+    string path = dir + "/journal";
+    int fresh = open((path + ".new").c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    DIE(fresh < 0, "open journal");
+    swap(journal, fresh);
+    close(fresh);
+
+    int mode = fsync;
+    fsync = FSYNC_NEVER;
+    for (const auto &client : clients) {
+        for (const auto &topic : client.topics) {
+            auto filter = client.filters.find(topic.first);
+            subscribed(client.id, topic.first, topic.second,
+                       filter == client.filters.end() ? "" : filter->second);
+        }
+        for (const auto &cursor : client.cursors)
+            away(client.id, cursor.first, cursor.second);
+    }
+    fsync = mode;
+
+    DIE(fdatasync(journal) < 0, "fdatasync");
+    DIE(rename((path + ".new").c_str(), path.c_str()) < 0, "rename journal");
+    return clients;
+}
+
+void Store::unsynced(SegmentLog *log) {
+    if (log->unsynced)
+        return;
+    log->unsynced = true;
+    pending.push_back(log);
+}
+
+void Store::sync() {
+    for (auto log : pending)
+        log->sync();
+    pending.clear();
+
+    if (journal_unsynced) {
+        DIE(fdatasync(journal) < 0, "fdatasync");
+        journal_unsynced = false;
+    }
+}
+
+uint64_t store_epoch(const string &root, uint64_t fresh) {
+    make_dir(root);
+    string path = root + "/epoch";
+
+    char text[32];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, text, sizeof(text) - 1);
+        DIE(n < 0, "read epoch");
+        close(fd);
+        text[n] = '\0';
+        uint64_t epoch = strtoull(text, nullptr, 10);
+        if (epoch)
+            return epoch;
+    } else {
+        DIE(errno != ENOENT, "open epoch");
+    }
+
+    // Written aside and renamed in, so a crash can't leave half of one
+    string temp = path + ".tmp";
+    int len = snprintf(text, sizeof(text), "%llu\n", (unsigned long long)fresh);
+    fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    DIE(fd < 0, "open epoch");
+    DIE(write(fd, text, len) != len, "write epoch");
+    DIE(fdatasync(fd) < 0, "fdatasync epoch");
+    close(fd);
+    DIE(rename(temp.c_str(), path.c_str()) < 0, "rename epoch");
+    return fresh;
+}
@@ -0,0 +1,170 @@
+#ifndef _SF_STORE_H
+#define _SF_STORE_H 1
+
+#include <cstdint>
+#include <deque>
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// When appended frames are forced down to the disk
+#define FSYNC_NEVER 0   // whenever the kernel gets to it
+#define FSYNC_BATCH 1   // once per event loop round
+#define FSYNC_ALWAYS 2  // before the append returns
+
+// A segment holds at most this many bytes of frames and entries
+#define SEGMENT_SIZE (4 * 1024 * 1024)
+#define SEGMENT_ENTRIES 16384
+
+// Where the frame for one log position sits in its segment
+struct __attribute__((__packed__)) segment_entry {
+    uint64_t order;
+    uint32_t offset;
+    uint32_t len;
+};
+
+// A run of consecutive log entries kept in two files, the compact
+// frames back to back and an index with a fixed size entry per frame.
+// Both are mapped whole, appends copy the frame first and its index
+// entry second, so after a crash the index ends at the last frame
+// that fully made it to the disk.
+class Segment {
+public:
+    // log position of index[0]
+    uint64_t first;
+
+    // entries and frame bytes in use
+    uint32_t count, used;
+
+    // now_ns() of the newest append, segments found on the disk count
+    // as written when they were opened
+    uint64_t newest;
+
+    // frames file and where it's mapped
+    int fd;
+    char *data;
+    segment_entry *index;
+
+    // Opens the segment starting at first, creating it if it's missing
+    Segment(const std::string &dir, uint64_t first);
+    Segment(const Segment &) = delete;
+    ~Segment();
+
+    bool fits(size_t len) const;
+    void append(const char *frame, size_t len, uint64_t order, uint64_t time);
+
+    // msync of everything appended since the last call
+    void sync();
+
+    // Deletes both files, the mappings stay valid until the destructor
+    void remove();
+
+private:
+    std::string path;
+    uint32_t synced_count, synced_used;
+};
+
+class Store;
+
+// Every segment of a topic log, oldest first
+class SegmentLog {
+public:
+    Store *store;
+    std::string dir;
+    std::deque<Segment *> segments;
+
+    // Set while appends are waiting for a FSYNC_BATCH sync
+    bool unsynced;
+
+    // Picks up the segments already in dir, an empty one starts at start
+    SegmentLog(Store *store, std::string dir, uint64_t start = 0);
+    SegmentLog(const SegmentLog &) = delete;
+    ~SegmentLog();
+
+    uint64_t first() const;
+    uint64_t next() const;
+
+    // Order of the newest entry, 0 if there is none
+    uint64_t last_order() const;
+
+    void append(const char *frame, size_t len, uint64_t order, uint64_t time);
+    Segment *segment_of(uint64_t pos) const;
+    const segment_entry &entry(uint64_t pos) const;
+    const char *frame(uint64_t pos) const;
+
+    // Frame bytes from pos to the end of the log
+    uint64_t bytes_from(uint64_t pos) const;
+
+    // Deletes the segments that end before oldest, the newest
+    // one always stays so the positions carry on after a restart
+    void trim(uint64_t oldest);
+    void sync();
+
+    // Deletes every segment, the log has to go away after this
+    void remove();
+};
+
+// A client as the journal remembers it: what it's subscribed to
+// and where it left off in its store and forward topics
+struct stored_client {
+    std::string id;
+    std::unordered_map<std::string, int> topics;
+    std::vector<std::pair<std::string, uint64_t>> cursors;
+
+    // Content filters of the topics that have one, as filter_text()
+    std::unordered_map<std::string, std::string> filters;
+};
+
+// Persistent state of one worker. Topic logs live under
+// dir/<hex topic>/ and the clients in an append only journal,
+// every line records one change to a client.
+class Store {
+public:
+    std::string dir;
+    int fsync;
+
+    Store(const std::string &root, int index, int fsync);
+    Store(const Store &) = delete;
+    ~Store();
+
+    SegmentLog *open_log(const std::string &topic);
+
+    // Whether topic has a log directory from an earlier run
+    bool has_log(const std::string &topic) const;
+
+    // A log that starts over at first, whatever was in its
+    // directory is thrown away (used for spilling, not for the store)
+    SegmentLog *fresh_log(const std::string &topic, uint64_t first);
+
+    void subscribed(const std::string &id, const std::string &topic, int sf,
+                    const std::string &filter = "");
+    void unsubscribed(const std::string &id, const std::string &topic);
+    void away(const std::string &id, const std::string &topic, uint64_t pos);
+    void back(const std::string &id);
+
+    // Replays the journal into the clients it describes and
+    // rewrites it with just their current state
+    std::vector<stored_client> recover();
+
+    // Remembers a log that has to be synced at the end of the round
+    void unsynced(SegmentLog *log);
+
+    // FSYNC_BATCH: syncs the journal and every log appended to
+    void sync();
+
+private:
+    int journal;
+    bool journal_unsynced;
+    std::vector<SegmentLog *> pending;
+
+    void record(const char *line, size_t len);
+};
+
+// The epoch kept in root, fresh is written there when there's none
+// yet. Sequence numbers carry on from the store after a restart,
+// so they stay with the epoch they were handed out under
+uint64_t store_epoch(const std::string &root, uint64_t fresh);
+
+#endif
@@ -0,0 +1,66 @@
+#include "slab.h"
+#include <new>
+
+// Free blocks are chained through their first word
+struct free_block {
+    free_block *next;
+};
+
+struct slab_cache {
+    free_block *lists[SLAB_CLASSES];
+    slab_stats stats;
+};
+
+// Zeroed for every new thread, and never torn down: blocks outlive the
+// thread that carved them whenever a worker is destroyed by another one
+static thread_local slab_cache cache;
+
+static int class_of(size_t size) {
+    if (size <= SLAB_MIN)
+        return 0;
+    return (int)(sizeof(unsigned long) * 8 - __builtin_clzl(size - 1)) - 4;
+}
+
+// Carves a new chunk into blocks of the class
+static void refill(int c) {
+    size_t block = (size_t)SLAB_MIN << c;
+    char *chunk = (char *)::operator new(SLAB_CHUNK);
+    cache.stats.reserved += SLAB_CHUNK;
+
+    for (size_t off = SLAB_CHUNK; off >= block; off -= block) {
+        auto *b = (free_block *)(chunk + off - block);
+        b->next = cache.lists[c];
+        cache.lists[c] = b;
+    }
+}
+
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX)
+        return ::operator new(size);
+
+    int c = class_of(size);
+    if (!cache.lists[c])
+        refill(c);
+
+    free_block *b = cache.lists[c];
+    cache.lists[c] = b->next;
+    cache.stats.in_use += SLAB_MIN << c;
+    return b;
+}
+
+void slab_free(void *p, size_t size) {
+    if (size > SLAB_MAX) {
+        ::operator delete(p);
+        return;
+    }
+
+    int c = class_of(size);
+    auto *b = (free_block *)p;
+    b->next = cache.lists[c];
+    cache.lists[c] = b;
+    cache.stats.in_use -= SLAB_MIN << c;
+}
+
+slab_stats slab_occupancy() {
+    return cache.stats;
+}
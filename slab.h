@@ -0,0 +1,52 @@
+#ifndef _SLAB_H
+#define _SLAB_H 1
+
+#include <cstddef>
+
+// Size classes go from SLAB_MIN to SLAB_MAX bytes, doubling each time,
+// anything bigger comes straight from the heap
+#define SLAB_MIN 16
+#define SLAB_MAX 4096
+#define SLAB_CLASSES 9
+
+// Every class carves its blocks out of chunks this big
+#define SLAB_CHUNK (64 * 1024)
+
+struct slab_stats {
+    size_t reserved;    // bytes of chunks taken from the heap
+    long in_use;        // bytes handed out and not freed yet
+};
+
+// Size class allocator for the small nodes the containers on the
+// message path keep allocating and freeing (deque blocks mostly).
+// Every thread has its own free lists, so it takes no locks and after
+// warming up never touches malloc. Chunks are never given back, a
+// freed block only ever serves its own size class again, which keeps
+// fragmentation down to what the busiest moment needed.
+// A block may be freed by another thread, it then joins that
+// thread's free list.
+void *slab_alloc(size_t size);
+void slab_free(void *p, size_t size);
+
+// What the calling thread's free lists hold
+slab_stats slab_occupancy();
+
+// Lets standard containers allocate through the slabs
+template <typename T>
+struct SlabAllocator {
+    typedef T value_type;
+
+    SlabAllocator() = default;
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U> &) {}
+
+    T *allocate(size_t n) { return (T *)slab_alloc(n * sizeof(T)); }
+    void deallocate(T *p, size_t n) { slab_free(p, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const SlabAllocator<T> &, const SlabAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const SlabAllocator<T> &, const SlabAllocator<U> &) { return false; }
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H 1
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free ring for exactly one producer thread and one
+// consumer thread. head and tail live on different cache lines so
+// the two sides don't keep stealing each other's line.
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of 2");
+
+    // next slot to pop, only written by the consumer
+    alignas(64) std::atomic<size_t> head{0};
+
+    // next slot to push, only written by the producer
+    alignas(64) std::atomic<size_t> tail{0};
+
+    alignas(64) T items[N];
+
+public:
+    // Producer side, returns false if the ring is full
+    bool push(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, returns false if the ring is empty
+    bool pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif
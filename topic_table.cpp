@@ -0,0 +1,17 @@
+#include "topic_table.h"
+
+uint32_t TopicTable::intern(const char *topic, size_t len) {
+    auto entry = ids.find(std::string_view(topic, len));
+    if (entry != ids.end())
+        return entry->second;
+
+    auto id = (uint32_t)names.size();
+    names.emplace_back(topic, len);
+    ids.emplace(names.back(), id);
+    return id;
+}
+
+uint32_t TopicTable::find(const std::string &topic) const {
+    auto entry = ids.find(std::string_view(topic));
+    return entry == ids.end() ? TOPIC_NONE : entry->second;
+}
@@ -0,0 +1,35 @@
+#ifndef _TOPIC_TABLE_H
+#define _TOPIC_TABLE_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define TOPIC_NONE UINT32_MAX
+
+// Hands out a small dense ID for every topic name it's shown, so
+// whatever is kept per topic can live in plain arrays indexed by it.
+// The lookup hashes the name where it is, nothing gets allocated
+// unless the topic is new.
+class TopicTable {
+public:
+    TopicTable() = default;
+    TopicTable(const TopicTable &) = delete;
+
+    uint32_t intern(const char *topic, size_t len);
+
+    // TOPIC_NONE if the topic was never interned
+    uint32_t find(const std::string &topic) const;
+    const std::string &name(uint32_t id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+private:
+    // A deque never moves its strings, so the views in ids stay valid
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include "topic_trie.h"
+#include <algorithm>
+
+using namespace std;
+
+vector<string> topic_levels(const string &topic) {
+    vector<string> levels;
+    size_t start = 0, end;
+    while ((end = topic.find(TOPIC_SEPARATOR, start)) != string::npos) {
+        levels.push_back(topic.substr(start, end - start));
+        start = end + 1;
+    }
+    levels.push_back(topic.substr(start));
+    return levels;
+}
+
+bool topic_is_exact(const string &pattern) {
+    for (const auto &level : topic_levels(pattern)) {
+        if (level == WILDCARD_ONE || level == WILDCARD_ANY)
+            return false;
+    }
+    return true;
+}
+
+// Levels of pattern from i on against levels of topic from j on
+static bool matches(const vector<string> &pattern, size_t i,
+                    const vector<string> &topic, size_t j) {
+    if (i == pattern.size())
+        return j == topic.size();
+
+    if (pattern[i] == WILDCARD_ANY) {
+        for (size_t k = j; k <= topic.size(); k++) {
+            if (matches(pattern, i + 1, topic, k))
+                return true;
+        }
+        return false;
+    }
+
+    if (j == topic.size())
+        return false;
+    if (pattern[i] != WILDCARD_ONE && pattern[i] != topic[j])
+        return false;
+    return matches(pattern, i + 1, topic, j + 1);
+}
+
+bool topic_matches(const string &pattern, const string &topic) {
+    if (pattern == topic)
+        return true;
+    return matches(topic_levels(pattern), 0, topic_levels(topic), 0);
+}
+
+TopicTrie::Node::~Node() {
+    for (auto &child : children)
+        delete child.second;
+    delete one;
+    delete any;
+}
+
+TopicTrie::TopicTrie() {
+    root = new Node();
+}
+
+TopicTrie::~TopicTrie() {
+    delete root;
+}
+
+void TopicTrie::insert(const string &pattern) {
+    Node *node = root;
+    for (const auto &level : topic_levels(pattern)) {
+        Node *&next = level == WILDCARD_ONE ? node->one :
+                      level == WILDCARD_ANY ? node->any : node->children[level];
+        if (!next)
+            next = new Node();
+        node = next;
+    }
+    if (!node->count++)
+        node->pattern = pattern;
+}
+
+void TopicTrie::remove(const string &pattern) {
+    // Remember the way down so empty nodes can be pruned on the way up
+    vector<pair<Node *, const string *>> path;
+    vector<string> levels = topic_levels(pattern);
+    Node *node = root;
+    for (const auto &level : levels) {
+        Node *next;
+        if (level == WILDCARD_ONE) {
+            next = node->one;
+        } else if (level == WILDCARD_ANY) {
+            next = node->any;
+        } else {
+            auto child = node->children.find(level);
+            next = child == node->children.end() ? nullptr : child->second;
+        }
+        if (!next)
+            return;
+        path.emplace_back(node, &level);
+        node = next;
+    }
+    if (!node->count || --node->count)
+        return;
+
+    for (size_t i = path.size(); i-- > 0;) {
+        Node *parent = path[i].first;
+        const string &level = *path[i].second;
+        Node *child = level == WILDCARD_ONE ? parent->one :
+                      level == WILDCARD_ANY ? parent->any : parent->children[level];
+        if (child->count || !child->children.empty() || child->one || child->any)
+            return;
+
+        delete child;
+        if (level == WILDCARD_ONE)
+            parent->one = nullptr;
+        else if (level == WILDCARD_ANY)
+            parent->any = nullptr;
+        else
+            parent->children.erase(level);
+    }
+}
+
+void TopicTrie::match(const string &topic, vector<const string *> &out) const {
+    size_t start = out.size();
+    match(root, topic_levels(topic), 0, out);
+
+    // A pattern with several '*' can match the same topic in more than one way
+    sort(out.begin() + start, out.end());
+    out.erase(unique(out.begin() + start, out.end()), out.end());
+}
+
+void TopicTrie::match(const Node *node, const vector<string> &levels, size_t i,
+                      vector<const string *> &out) const {
+    if (i == levels.size()) {
+        if (node->count)
+            out.push_back(&node->pattern);
+    } else {
+        auto child = node->children.find(levels[i]);
+        if (child != node->children.end())
+            match(child->second, levels, i + 1, out);
+        if (node->one)
+            match(node->one, levels, i + 1, out);
+    }
+
+    // '*' takes none or any number of the levels that are left
+    if (node->any) {
+        for (size_t j = i; j <= levels.size(); j++)
+            match(node->any, levels, j, out);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef _TOPIC_TRIE_H
+#define _TOPIC_TRIE_H 1
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Topics are split into levels by '/'. In a subscription a '+' level
+// matches exactly one level of the topic and a '*' level matches any
+// number of them, none included.
+#define TOPIC_SEPARATOR '/'
+#define WILDCARD_ONE "+"
+#define WILDCARD_ANY "*"
+
+// The subscription patterns in use, one level per node, so matching a
+// topic only walks as deep as the topic and never looks at patterns
+// that can't match it.
+class TopicTrie {
+public:
+    TopicTrie();
+    TopicTrie(const TopicTrie &) = delete;
+    ~TopicTrie();
+
+    // Patterns are counted, remove has to be called once per insert
+    void insert(const std::string &pattern);
+    void remove(const std::string &pattern);
+
+    // Every pattern that matches topic, each one once
+    void match(const std::string &topic, std::vector<const std::string *> &out) const;
+
+    bool empty() const { return root->children.empty() && !root->one && !root->any; }
+
+private:
+    struct Node {
+        std::unordered_map<std::string, Node *> children;
+        Node *one, *any;
+
+        // how many times the pattern ending here was inserted
+        int count;
+        std::string pattern;
+
+        Node() : one(nullptr), any(nullptr), count(0) {}
+        ~Node();
+    };
+
+    Node *root;
+
+    void match(const Node *node, const std::vector<std::string> &levels, size_t i,
+               std::vector<const std::string *> &out) const;
+};
+
+// Splits a topic or a pattern into its levels
+std::vector<std::string> topic_levels(const std::string &topic);
+
+// true if the pattern has no wildcard levels
+bool topic_is_exact(const std::string &pattern);
+
+bool topic_matches(const std::string &pattern, const std::string &topic);
+
+#endif
@@ -0,0 +1,174 @@
+#include "uring.h"
+#include "helpers.h"
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned wait_nr, unsigned flags,
+                          void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait_nr, flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+Uring::Uring(unsigned entries) {
+    struct io_uring_params p{};
+
+    // Completions are only looked at when we enter anyway, so the
+    // kernel doesn't need to interrupt us to post them
+    p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    fd = io_uring_setup(entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        p = io_uring_params{};
+        fd = io_uring_setup(entries, &p);
+    }
+    DIE(fd < 0, "io_uring_setup");
+    DIE(!(p.features & IORING_FEAT_EXT_ARG), "io_uring is too old");
+
+    sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_map_len = cq_map_len = std::max(sq_map_len, cq_map_len);
+
+    sq_map = mmap(nullptr, sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQ_RING);
+    DIE(sq_map == MAP_FAILED, "mmap sq");
+    cq_map = sq_map;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_map = mmap(nullptr, cq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        DIE(cq_map == MAP_FAILED, "mmap cq");
+    }
+
+    sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    DIE(sqes == MAP_FAILED, "mmap sqes");
+
+    char *sq = (char *)sq_map, *cq = (char *)cq_map;
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    sq_entries = p.sq_entries;
+    sq_queued = 0;
+
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Entry i of the queue is always sqes[i]
+    for (unsigned i = 0; i < sq_entries; i++)
+        sq_array[i] = i;
+    nrings = 0;
+}
+
+Uring::~Uring() {
+    for (int i = 0; i < nrings; i++)
+        munmap(rings[i], ring_lens[i]);
+    munmap(sqes, sqes_len);
+    if (cq_map != sq_map)
+        munmap(cq_map, cq_map_len);
+    munmap(sq_map, sq_map_len);
+    close(fd);
+}
+
+struct io_uring_sqe *Uring::sqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail;
+    if (tail - head >= sq_entries) {
+        DIE(enter(0, 0) < 0, "io_uring_enter");
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        DIE(tail - head >= sq_entries, "io_uring submission queue full");
+    }
+
+    struct io_uring_sqe *entry = &sqes[tail & *sq_mask];
+    memset(entry, 0, sizeof(*entry));
+
+    // Nothing reads the queue until the next enter(), so the entry
+    // can be filled in after the tail moved past it
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    sq_queued++;
+    return entry;
+}
+
+int Uring::enter(unsigned wait_nr, int timeout) {
+    unsigned flags = 0;
+    struct __kernel_timespec ts{};
+    struct io_uring_getevents_arg arg{};
+
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+            arg.ts = (uint64_t)&ts;
+        }
+        arg.sigmask_sz = _NSIG / 8;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int ret = io_uring_enter(fd, sq_queued, wait_nr, flags,
+                             flags & IORING_ENTER_EXT_ARG ? &arg : nullptr,
+                             flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    if (ret >= 0) {
+        sq_queued -= std::min((unsigned)ret, sq_queued);
+        return ret;
+    }
+    if (errno == ETIME || errno == EINTR || errno == EBUSY)
+        return 0;
+    return -1;
+}
+
+unsigned Uring::ready() const {
+    return __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head;
+}
+
+const struct io_uring_cqe *Uring::cqe(unsigned i) const {
+    return &cqes[(*cq_head + i) & *cq_mask];
+}
+
+void Uring::seen(unsigned n) {
+    __atomic_store_n(cq_head, *cq_head + n, __ATOMIC_RELEASE);
+}
+
+struct io_uring_buf_ring *Uring::buf_ring(unsigned entries, int group) {
+    if (nrings == (int)(sizeof(rings) / sizeof(rings[0])))
+        return nullptr;
+
+    size_t len = entries * sizeof(struct io_uring_buf);
+    void *ring = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    DIE(ring == MAP_FAILED, "mmap buf ring");
+
+    struct io_uring_buf_reg reg{};
+    reg.ring_addr = (uint64_t)ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, len);
+        return nullptr;
+    }
+
+    rings[nrings] = (struct io_uring_buf_ring *)ring;
+    ring_lens[nrings++] = len;
+    return (struct io_uring_buf_ring *)ring;
+}
+
+void Uring::buf_add(struct io_uring_buf_ring *ring, unsigned entries, void *addr,
+                    unsigned len, uint16_t bid) {
+    // Entries start right at the ring, the tail sits in the first one.
+    // Not through ring->bufs, in C++ the header puts it 8 bytes in
+    uint16_t tail = ring->tail;
+    struct io_uring_buf *buf = (struct io_uring_buf *)ring + (tail & (entries - 1));
+    buf->addr = (uint64_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+    __atomic_store_n(&ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,62 @@
+#ifndef _URING_H
+#define _URING_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// Minimal io_uring over the raw system calls. Submissions are only
+// queued by sqe(), enter() hands every queued one to the kernel in a
+// single system call and can wait for completions at the same time.
+// Only ever used by one thread.
+class Uring {
+public:
+    explicit Uring(unsigned entries);
+    Uring(const Uring &) = delete;
+    ~Uring();
+
+    // Next submission entry, cleared. When the queue is full what's
+    // queued is submitted first to make room
+    struct io_uring_sqe *sqe();
+
+    // Submits everything queued and waits up to timeout ms (-1 forever)
+    // for at least wait_nr completions. Returns -1 with errno set on
+    // failure, a timeout or a signal is not one
+    int enter(unsigned wait_nr, int timeout);
+
+    // Completions are read in place: ready() of them starting at
+    // cqe(0), seen() gives the first n back to the kernel
+    unsigned ready() const;
+    const struct io_uring_cqe *cqe(unsigned i) const;
+    void seen(unsigned n);
+
+    // Ring of buffers the kernel picks from for multishot receives,
+    // entries must be a power of two. Returns nullptr if the kernel
+    // doesn't support it
+    struct io_uring_buf_ring *buf_ring(unsigned entries, int group);
+    void buf_add(struct io_uring_buf_ring *ring, unsigned entries, void *addr,
+                 unsigned len, uint16_t bid);
+
+private:
+    int fd;
+
+    // Submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_queued;
+
+    // Completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+
+    // Buffer rings to unmap on the way out
+    struct io_uring_buf_ring *rings[4];
+    size_t ring_lens[4];
+    int nrings;
+};
+
+#endif